@@ -0,0 +1,87 @@
+/** @file
+ * Benchmark of operations failing on lookup: listing and removing folders
+ * which do not exist and creating folders which already exist.
+ * @date 2022
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/tree.h"
+#include "../test/test_util.h"
+
+/** Number of probes per measurement */
+#define PROBES 1000000
+
+/** Number of distinct names probed */
+#define NAMES 4096
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Kinds of measured probes */
+typedef enum Probe { PROBE_LIST, PROBE_REMOVE, PROBE_CREATE } Probe;
+
+/** Gives the average time of a failing probe in nanoseconds. */
+static double measure(Tree* tree, char (*paths)[32], Probe probe, int expected) {
+    double start = now_ns();
+
+    for (int i = 0; i < PROBES; ++i) {
+        const char* path = paths[i % NAMES];
+        int err;
+
+        switch (probe) {
+            case PROBE_LIST:
+                err = (tree_list(tree, path) ? 0 : ENOENT);
+                break;
+            case PROBE_REMOVE:
+                err = tree_remove(tree, path);
+                break;
+            default:
+                err = tree_create(tree, path);
+        }
+
+        if (err != expected) {
+            fprintf(stderr, "unexpected result %d for %s\n", err, path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return (now_ns() - start) / PROBES;
+}
+
+int main(void) {
+    static char present[NAMES][32];
+    static char absent[NAMES][32];
+    const unsigned int sizes[] = {8, 64, 512, 4096};
+
+    printf("%10s %14s %14s %14s\n", "children", "list ENOENT", "remove ENOENT", "create EEXIST");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        Tree* tree = tree_new();
+
+        for (unsigned int i = 0; i < NAMES; ++i) {
+            make_path(present[i], "dir", i % sizes[s]);
+            make_path(absent[i], "dir", sizes[s] + i);
+        }
+
+        for (unsigned int i = 0; i < sizes[s]; ++i)
+            tree_create(tree, present[i]);
+
+        printf("%10u %11.1f ns %11.1f ns %11.1f ns\n", sizes[s],
+               measure(tree, absent, PROBE_LIST, ENOENT),
+               measure(tree, absent, PROBE_REMOVE, ENOENT),
+               measure(tree, present, PROBE_CREATE, EEXIST));
+
+        tree_free(tree);
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+/** @file
+ * Benchmark of a sharded hierarchy under threads working in separate top-level
+ * folders. Every thread is pinned to a processor and works in a folder of
+ * the shard it is dedicated to, so with as many shards as threads no lock
+ * is shared, while with a single shard all of them pass through one root.
+ * @date 2022
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/shard.h"
+#include "../test/test_util.h"
+
+/** Number of working threads */
+#define THREADS 8
+
+/** Number of operations per thread */
+#define OPERATIONS 200000
+
+/** Work of a single thread */
+typedef struct Worker {
+    pthread_t thread;
+    ShardedTree* tree;
+    pthread_barrier_t* start;
+    size_t processor;
+    char top[32]; // Top-level folder of the thread.
+} Worker;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Creates, lists and removes folders inside the top-level folder of the worker. */
+static void* work(void* data) {
+    Worker* worker = data;
+    char path[64];
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->processor, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    pthread_barrier_wait(worker->start);
+
+    for (unsigned int i = 0; i < OPERATIONS / 3; ++i) {
+        snprintf(path, sizeof(path), "%s%c/", worker->top, 'a' + i % 26);
+        sharded_tree_create(worker->tree, path);
+        free(sharded_tree_list(worker->tree, worker->top));
+        sharded_tree_remove(worker->tree, path);
+    }
+
+    return NULL;
+}
+
+/** Gives the throughput of THREADS workers in millions of operations per second. */
+static double measure(size_t shards) {
+    ShardedTree* tree = sharded_tree_new(shards);
+    Worker workers[THREADS];
+    pthread_barrier_t start;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int name = 0;
+
+    pthread_barrier_init(&start, NULL, THREADS + 1);
+
+    for (size_t i = 0; i < THREADS; ++i) {
+        // Thread i serves shard i % shards, in a top-level folder of its own.
+        do {
+            make_path(workers[i].top, "", name++);
+        } while (sharded_tree_shard(tree, workers[i].top) != i % shards);
+
+        sharded_tree_create(tree, workers[i].top);
+        workers[i].tree = tree;
+        workers[i].start = &start;
+        workers[i].processor = i % (processors > 0 ? (size_t) processors : 1);
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    double begin = now_s();
+
+    for (size_t i = 0; i < THREADS; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    double elapsed = now_s() - begin;
+
+    pthread_barrier_destroy(&start);
+    sharded_tree_free(tree);
+
+    return THREADS * (OPERATIONS / 3 * 3) / elapsed / 1e6;
+}
+
+int main(void) {
+    const size_t shards[] = {1, 2, 4, 8};
+    double base = 0;
+
+    printf("%d threads on %ld processors\n", THREADS, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %12s %9s\n", "shards", "Mops/s", "speedup");
+
+    for (size_t s = 0; s < sizeof(shards) / sizeof(shards[0]); ++s) {
+        double throughput = measure(shards[s]);
+
+        if (s == 0)
+            base = throughput;
+
+        printf("%8zu %12.2f %8.2fx\n", shards[s], throughput, throughput / base);
+    }
+
+    return 0;
+}
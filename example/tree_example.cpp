@@ -0,0 +1,40 @@
+/** @file
+ * Example usage of file manager from C++.
+ * @date 2022
+*/
+
+#include <iostream>
+#include <string_view>
+
+#include "../src/tree.hpp"
+
+int main() {
+    /* Creates the root folder */
+    file_manager::Tree tree;
+
+    /* Paths may be parts of larger strings, they are not copied */
+    std::string_view paths = "/a/b/c/";
+
+    /* Creates folders 'a', 'b' inside 'a' and 'c' inside 'b' */
+    for (std::size_t end = 3; end <= paths.size(); end += 2)
+        tree.create(paths.substr(0, end));
+
+    /* Moves folder 'c' from folder 'b' to the root */
+    tree.move("/a/b/c/", "/c/");
+
+    /* Names are borrowed from a snapshot, which outlives changes of the folder */
+    file_manager::Listing content = tree.list("/");
+    tree.remove("/c/");
+
+    /* This prints 'a' and 'c' */
+    for (std::string_view name : content)
+        std::cout << name << '\n';
+
+    /* Finds all folders named 'b', however deep they are */
+    tree.find("/", "**/b", [](std::string_view path) {
+        std::cout << path << '\n';
+        return true;
+    });
+
+    return 0;
+}
@@ -1,51 +1,101 @@
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "hash.h"
 
-/* We fix the number of hash buckets for simplicity. */
-#define BUCKETS_COUNT 8
+/* Number of hash buckets of a new map, which are kept inline. */
+#define MIN_BUCKETS_COUNT 8
+
+/* Average number of pairs per bucket above which a map should grow. */
+#define MAX_LOAD 2
+
+/* A map is shrunk once it uses less than one in SPARSE_LOAD buckets. */
+#define SPARSE_LOAD 8
 
 typedef struct Pair Pair;
 
 struct Pair {
     char* key;
     void* value;
-    Pair* next; // Next item in a single-linked list.
+    Pair* next; // Next item in a single-linked list, fixed once published.
 };
 
+typedef struct Bucket {
+    _Atomic(Pair*) head; // Linked list of key-value pairs.
+    _Atomic(uint64_t) filter; // Bloom filter of the keys, sharing a cache line with the head.
+} Bucket;
+
 struct HashMap {
-    Pair* buckets[BUCKETS_COUNT]; // Linked lists of key-value pairs.
-    size_t size; // total number of entries in map.
+    Bucket* buckets; // Either small_buckets or a separate allocation, a power of two of them.
+    size_t buckets_count;
+    atomic_size_t size; // total number of entries in map.
+    atomic_size_t key_bytes; // total size of copied keys, including null characters.
+    bool borrows_keys; // Are keys stored as given rather than copied?
+    Bucket small_buckets[MIN_BUCKETS_COUNT];
 };
 
 static unsigned int get_hash(const char* key);
+static uint64_t get_fingerprint(unsigned int hash);
 
-HashMap* hmap_new() {
+static HashMap* hmap_create(bool borrows_keys) {
     HashMap* map = malloc(sizeof(HashMap));
 
     if (!map)
         return NULL;
 
-    memset(map, 0, sizeof(HashMap));
+    for (size_t h = 0; h < MIN_BUCKETS_COUNT; ++h) {
+        atomic_init(&map->small_buckets[h].head, NULL);
+        atomic_init(&map->small_buckets[h].filter, 0);
+    }
+
+    map->buckets = map->small_buckets;
+    map->buckets_count = MIN_BUCKETS_COUNT;
+    atomic_init(&map->size, 0);
+    atomic_init(&map->key_bytes, 0);
+    map->borrows_keys = borrows_keys;
     return map;
 }
 
+HashMap* hmap_new() {
+    return hmap_create(false);
+}
+
+HashMap* hmap_new_borrowing() {
+    return hmap_create(true);
+}
+
+/** Frees a pair together with its key, unless the key is borrowed. */
+static void hmap_free_pair(HashMap* map, Pair* p) {
+    if (!map->borrows_keys)
+        free(p->key);
+
+    free(p);
+}
+
 void hmap_free(HashMap* map) {
-    for (int h = 0; h < BUCKETS_COUNT; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
+    for (size_t h = 0; h < map->buckets_count; ++h) {
+        for (Pair* p = atomic_load_explicit(&map->buckets[h].head, memory_order_relaxed); p;) {
             Pair* q = p;
             p = p->next;
-            free(q->key);
-            free(q);
+            hmap_free_pair(map, q);
         }
     }
 
+    if (map->buckets != map->small_buckets)
+        free(map->buckets);
+
     free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key) {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
+/**
+ * Searches a bucket fragment starting at @p first and ending just before @p last.
+ * Pairs are only ever pushed in front of a bucket, so a fragment seen once stays intact
+ * for as long as no one removes from the map.
+ */
+static Pair* hmap_find(Pair* first, Pair* last, const char* key) {
+    for (Pair* p = first; p != last; p = p->next) {
         if (strcmp(key, p->key) == 0)
             return p;
     }
@@ -53,9 +103,28 @@ static Pair* hmap_find(HashMap* map, int h, const char* key) {
     return NULL;
 }
 
+static Pair* hmap_head(HashMap* map, size_t h) {
+    return atomic_load_explicit(&map->buckets[h].head, memory_order_acquire);
+}
+
+/**
+ * Checks the bucket filter for a key fingerprint. A negative answer is definite,
+ * since filter bits are set before the pair is published and cleared only by removals.
+ */
+static bool hmap_may_contain(HashMap* map, size_t h, uint64_t fingerprint) {
+    uint64_t filter = atomic_load_explicit(&map->buckets[h].filter, memory_order_acquire);
+
+    return (filter & fingerprint) == fingerprint;
+}
+
 void* hmap_get(HashMap* map, const char* key) {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    unsigned int hash = get_hash(key);
+    size_t h = hash & (map->buckets_count - 1);
+
+    if (!hmap_may_contain(map, h, get_fingerprint(hash)))
+        return NULL;
+
+    Pair* p = hmap_find(hmap_head(map, h), NULL, key);
 
     return p ? p->value : NULL;
 }
@@ -64,56 +133,214 @@ bool hmap_insert(HashMap* map, const char* key, void* value) {
     if (!value)
         return false;
 
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
+    unsigned int hash = get_hash(key);
+    size_t h = hash & (map->buckets_count - 1);
+    uint64_t fingerprint = get_fingerprint(hash);
+    Pair* seen = hmap_head(map, h);
 
-    if (p)
+    if (hmap_may_contain(map, h, fingerprint) && hmap_find(seen, NULL, key))
         return false; // Already exists.
 
     Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    new_p->key = (map->borrows_keys ? (char*) key : strdup(key));
     new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
-    map->size++;
+    new_p->next = seen;
+
+    atomic_fetch_or_explicit(&map->buckets[h].filter, fingerprint, memory_order_release);
+
+    // A failed CAS loads the current head into new_p->next. Only the pairs
+    // pushed since the last attempt may hold the key, so just those are checked.
+    while (!atomic_compare_exchange_weak_explicit(&map->buckets[h].head, &new_p->next, new_p,
+                                                  memory_order_release, memory_order_acquire)) {
+        if (hmap_find(new_p->next, seen, key)) {
+            hmap_free_pair(map, new_p);
+            return false; // Inserted concurrently.
+        }
+
+        seen = new_p->next;
+    }
+
+    atomic_fetch_add_explicit(&map->size, 1, memory_order_relaxed);
+    if (!map->borrows_keys)
+        atomic_fetch_add_explicit(&map->key_bytes, strlen(key) + 1, memory_order_relaxed);
 
     return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key) {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-
-    while (*pp) {
-        Pair* p = *pp;
+    size_t h = get_hash(key) & (map->buckets_count - 1);
+    Pair* p = atomic_load_explicit(&map->buckets[h].head, memory_order_relaxed);
+    Pair* prev = NULL;
+    uint64_t filter = 0; // Filter of the pairs staying in the bucket.
 
+    while (p) {
         if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
+            if (prev)
+                prev->next = p->next;
+            else
+                atomic_store_explicit(&map->buckets[h].head, p->next, memory_order_relaxed);
+
+            for (Pair* q = p->next; q; q = q->next)
+                filter |= get_fingerprint(get_hash(q->key));
+
+            // Bits cannot be taken out of a Bloom filter, so it is rebuilt instead.
+            atomic_store_explicit(&map->buckets[h].filter, filter, memory_order_relaxed);
+
+            if (!map->borrows_keys)
+                atomic_fetch_sub_explicit(&map->key_bytes, strlen(p->key) + 1, memory_order_relaxed);
+            hmap_free_pair(map, p);
+
+            size_t size = atomic_fetch_sub_explicit(&map->size, 1, memory_order_relaxed) - 1;
+            if (map->buckets_count > MIN_BUCKETS_COUNT && size * SPARSE_LOAD < map->buckets_count)
+                hmap_fit(map);
+
             return true;
         }
 
-        pp = &(p->next);
+        filter |= get_fingerprint(get_hash(p->key));
+        prev = p;
+        p = p->next;
     }
 
     return false;
 }
 
 size_t hmap_size(HashMap* map) {
-    return map->size;
+    return atomic_load_explicit(&map->size, memory_order_relaxed);
+}
+
+bool hmap_update(HashMap* map, const char* key, void* value) {
+    unsigned int hash = get_hash(key);
+    Pair* p = hmap_find(hmap_head(map, hash & (map->buckets_count - 1)), NULL, key);
+
+    if (!p)
+        return false;
+
+    p->value = value;
+    return true;
+}
+
+uint64_t hmap_fingerprint(const char* key) {
+    return get_fingerprint(get_hash(key));
+}
+
+bool hmap_is_crowded(HashMap* map) {
+    return hmap_size(map) >= MAX_LOAD * map->buckets_count;
+}
+
+void hmap_fit(HashMap* map) {
+    size_t count = MIN_BUCKETS_COUNT;
+
+    while (count < hmap_size(map))
+        count *= 2;
+
+    if (count == map->buckets_count)
+        return;
+
+    Bucket* old_buckets = map->buckets;
+    size_t old_count = map->buckets_count;
+    Bucket* buckets = (count == MIN_BUCKETS_COUNT ? map->small_buckets : malloc(count * sizeof(Bucket)));
+
+    if (!buckets)
+        return; // The map keeps working, just with longer chains.
+
+    // Shrinking back to the inline buckets reuses them, so pairs are detached first.
+    Pair* pairs = NULL;
+    for (size_t h = 0; h < old_count; ++h) {
+        Pair* p = atomic_load_explicit(&old_buckets[h].head, memory_order_relaxed);
+
+        while (p) {
+            Pair* next = p->next;
+            p->next = pairs;
+            pairs = p;
+            p = next;
+        }
+    }
+
+    for (size_t h = 0; h < count; ++h) {
+        atomic_init(&buckets[h].head, NULL);
+        atomic_init(&buckets[h].filter, 0);
+    }
+
+    while (pairs) {
+        Pair* p = pairs;
+        unsigned int hash = get_hash(p->key);
+        Bucket* bucket = &buckets[hash & (count - 1)];
+
+        pairs = p->next;
+        p->next = atomic_load_explicit(&bucket->head, memory_order_relaxed);
+        atomic_store_explicit(&bucket->head, p, memory_order_relaxed);
+        atomic_fetch_or_explicit(&bucket->filter, get_fingerprint(hash), memory_order_relaxed);
+    }
+
+    if (old_buckets != map->small_buckets)
+        free(old_buckets);
+
+    map->buckets = buckets;
+    map->buckets_count = count;
+}
+
+HashMapMemory hmap_memory(HashMap* map) {
+    size_t table = sizeof(HashMap);
+
+    if (map->buckets != map->small_buckets)
+        table += map->buckets_count * sizeof(Bucket);
+
+    size_t entries = hmap_size(map) * sizeof(Pair) +
+                     atomic_load_explicit(&map->key_bytes, memory_order_relaxed);
+
+    return (HashMapMemory){table, entries};
+}
+
+/** Loads all bucket heads into @p heads. */
+static void hmap_collect(HashMap* map, Pair** heads) {
+    for (size_t h = 0; h < map->buckets_count; ++h)
+        heads[h] = hmap_head(map, h);
+}
+
+const char** hmap_keys(HashMap* map, size_t* count) {
+    size_t heads_size = map->buckets_count * sizeof(Pair*);
+    Pair** heads = malloc(2 * heads_size);
+    Pair** previous = heads + map->buckets_count;
+
+    // Nothing is unlinked while readers are around, so two identical collects
+    // mean that all the heads held these values at once between them.
+    hmap_collect(map, heads);
+    do {
+        memcpy(previous, heads, heads_size);
+        hmap_collect(map, heads);
+    } while (memcmp(previous, heads, heads_size) != 0);
+
+    size_t keys_count = 0;
+    for (size_t h = 0; h < map->buckets_count; ++h) {
+        for (Pair* p = heads[h]; p; p = p->next)
+            keys_count++;
+    }
+
+    const char** result = calloc(keys_count + 1, sizeof(char*));
+    const char** key = result;
+
+    for (size_t h = 0; h < map->buckets_count; ++h) {
+        for (Pair* p = heads[h]; p; p = p->next)
+            *key++ = p->key;
+    }
+
+    *key = NULL; // Set last array element to NULL.
+    *count = keys_count;
+    free(heads);
+
+    return result;
 }
 
 HashMapIterator hmap_iterator(HashMap* map) {
-    return (HashMapIterator){0, map->buckets[0]};
+    return (HashMapIterator){0, hmap_head(map, 0)};
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value) {
     Pair* p = it->pair;
 
-    while (!p && it->bucket < BUCKETS_COUNT - 1) {
-        p = map->buckets[++it->bucket];
+    while (!p && it->bucket + 1 < (int) map->buckets_count) {
+        p = hmap_head(map, ++it->bucket);
     }
 
     if (!p)
@@ -134,5 +361,21 @@ static unsigned int get_hash(const char* key) {
         ++key;
     }
 
-    return hash % BUCKETS_COUNT;
+    return hash;
+}
+
+/**
+ * Gives the two filter bits of a key. The hash is mixed first (MurmurHash3 finalizer),
+ * as the bits used to pick the bucket must not decide the fingerprint as well.
+ */
+static uint64_t get_fingerprint(unsigned int hash) {
+    uint32_t mixed = hash;
+
+    mixed ^= mixed >> 16;
+    mixed *= 0x85ebca6bu;
+    mixed ^= mixed >> 13;
+    mixed *= 0xc2b2ae35u;
+    mixed ^= mixed >> 16;
+
+    return ((uint64_t) 1 << (mixed & 63)) | ((uint64_t) 1 << ((mixed >> 6) & 63));
 }
@@ -1,11 +1,15 @@
 /** @file
  * Hashmap storing universal pointers.
+ * Lookups (hmap_get, hmap_keys, iteration) and insertions (hmap_insert) may run
+ * concurrently with each other: an entry is published with a single CAS on its bucket head.
+ * All the other operations require exclusive access to the map.
  * @date 2022
 */
 
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 typedef struct HashMap HashMap;
@@ -16,9 +20,17 @@ typedef struct HashMap HashMap;
  */
 HashMap* hmap_new();
 
+/**
+ * Creates empty hash map which stores keys given to hmap_insert rather than
+ * their copies. Each key has to stay valid and unchanged for as long as its
+ * entry is in the map, which saves a copy when the key is also kept elsewhere.
+ * @return allocated map
+ */
+HashMap* hmap_new_borrowing();
+
 /**
  * Clear the map and free its memory. This frees the map and the keys
- * copied by hmap_insert, but does not free any values.
+ * copied by hmap_insert, but does not free any values or borrowed keys.
  * @param map map to free
  */
 void hmap_free(HashMap* map);
@@ -32,7 +44,10 @@ void* hmap_get(HashMap* map, const char* key);
 /**
  * Insert a `value` under `key` and return true, or do nothing
  * and return false if `key` already exists in the map. The caller
- * can free `key` at any time - the map internally uses a copy of it.
+ * can free `key` at any time - the map internally uses a copy of it,
+ * unless it was made by hmap_new_borrowing.
+ * Concurrent insertions of the same key are resolved by the bucket CAS:
+ * exactly one of them succeeds.
  * @return is @p key unused in @p map?
  */
 bool hmap_insert(HashMap* map, const char* key, void* value);
@@ -46,10 +61,68 @@ bool hmap_remove(HashMap* map, const char* key);
 
 size_t hmap_size(HashMap* map);
 
+/**
+ * Replaces the value of an existing key. Requires exclusive access to the map,
+ * though it may be iterated meanwhile.
+ * @param map map to modify
+ * @param key existing key
+ * @param value new value
+ * @return true if @p key was found
+ */
+bool hmap_update(HashMap* map, const char* key, void* value);
+
+/**
+ * Gives the bits that a key sets in the Bloom filters of maps, so that
+ * other containers of keys can filter lookups the same way.
+ * @param key key to fingerprint
+ * @return filter bits of @p key
+ */
+uint64_t hmap_fingerprint(const char* key);
+
+/**
+ * Checks whether the map holds so many entries that lookups slow down
+ * and it should be grown with hmap_fit.
+ * @param map map to check
+ * @return is @p map crowded?
+ */
+bool hmap_is_crowded(HashMap* map);
+
+/**
+ * Resizes the bucket table to the number of entries. Maps are shrunk
+ * this way automatically when removals leave most buckets unused.
+ * @param map map to resize
+ */
+void hmap_fit(HashMap* map);
+
+/** Memory used by a map, in bytes */
+typedef struct HashMapMemory {
+    size_t table; /** The map itself with its bucket table and filters */
+    size_t entries; /** Entries with copies of their keys, borrowed keys are not counted */
+} HashMapMemory;
+
+/**
+ * Gives the number of bytes used by the map, not including values.
+ * @param map map to measure
+ * @return memory used by @p map
+ */
+HashMapMemory hmap_memory(HashMap* map);
+
+/**
+ * Gives a NULL-terminated array of keys present in the map at a single
+ * point in time, even if insertions are running concurrently.
+ * Keys are not copied, they are only valid as long as their entries.
+ * The caller should free the result.
+ * @param map source of keys
+ * @param count where to store the number of keys
+ * @return buffer with keys of @p map
+ */
+const char** hmap_keys(HashMap* map, size_t* count);
+
 typedef struct HashMapIterator HashMapIterator;
 
 /**
- * Return an iterator to the map. See `hmap_next`.
+ * Return an iterator to the map. See `hmap_next`. Entries inserted while
+ * iterating may or may not be visited.
  * @return begin iterator
  */
 HashMapIterator hmap_iterator(HashMap* map);
@@ -0,0 +1,78 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard.h"
+#include "tree.h"
+#include "util/err.h"
+
+struct ShardedTree {
+    size_t count; // Number of shards.
+    Tree* shards[];
+};
+
+ShardedTree* sharded_tree_new(size_t shards) {
+    ShardedTree* tree = (shards ? malloc(sizeof(ShardedTree) + shards * sizeof(Tree*)) : NULL);
+
+    if (!tree)
+        fatal(__FUNCTION__);
+
+    tree->count = shards;
+
+    for (size_t i = 0; i < shards; ++i)
+        tree->shards[i] = tree_new();
+
+    return tree;
+}
+
+void sharded_tree_free(ShardedTree* tree) {
+    if (!tree)
+        return;
+
+    for (size_t i = 0; i < tree->count; ++i)
+        tree_free(tree->shards[i]);
+
+    free(tree);
+}
+
+size_t sharded_tree_shard(const ShardedTree* tree, const char* path) {
+    unsigned int hash = 2166136261u; // FNV-1a of the top-level folder name.
+
+    for (const char* c = path + 1; *c && *c != '/'; ++c)
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+    return hash % tree->count;
+}
+
+/**
+ * Gives the shard holding @p path. Any string is hashed safely, so an invalid
+ * path is left for the shard to reject.
+ */
+static Tree* sharded_tree_get(ShardedTree* tree, const char* path) {
+    return tree->shards[*path ? sharded_tree_shard(tree, path) : 0];
+}
+
+char* sharded_tree_list(ShardedTree* tree, const char* path) {
+    if (!path)
+        return NULL;
+    if (strcmp(path, "/") == 0)
+        return tree_list_roots(tree->shards, tree->count);
+
+    return tree_list(sharded_tree_get(tree, path), path);
+}
+
+int sharded_tree_create(ShardedTree* tree, const char* path) {
+    return path ? tree_create(sharded_tree_get(tree, path), path) : EINVAL;
+}
+
+int sharded_tree_remove(ShardedTree* tree, const char* path) {
+    return path ? tree_remove(sharded_tree_get(tree, path), path) : EINVAL;
+}
+
+int sharded_tree_move(ShardedTree* tree, const char* source, const char* target) {
+    if (!source || !target)
+        return EINVAL;
+
+    return tree_move_across(sharded_tree_get(tree, source), source, strlen(source),
+                            sharded_tree_get(tree, target), target, strlen(target));
+}
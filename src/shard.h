@@ -0,0 +1,51 @@
+/** @file
+ * File hierarchy split into shards by top-level folders.
+ * Each shard is a hierarchy of its own, with its own root and locks, holding the
+ * top-level folders whose names hash to it together with their whole subtrees.
+ * Operations below different top-level folders of different shards never touch
+ * the same lock, while the semantics stay those of a single hierarchy.
+ * @date 2022
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+typedef struct ShardedTree ShardedTree;
+
+/**
+ * Creates an empty sharded hierarchy.
+ * @param shards number of shards, at least one
+ * @return allocated hierarchy
+ */
+ShardedTree* sharded_tree_new(size_t shards);
+
+void sharded_tree_free(ShardedTree* tree);
+
+/**
+ * Gives the index of the shard holding a path, so that work on it can be routed
+ * to threads dedicated to that shard. "/" belongs to all of them.
+ * @param tree sharded hierarchy
+ * @param path valid path other than "/"
+ * @return index of the shard, less than the number of shards
+ */
+size_t sharded_tree_shard(const ShardedTree* tree, const char* path);
+
+/**
+ * See tree_list. Listing "/" locks the roots of all the shards for writing,
+ * see tree_list_roots, so it stalls every operation until it is done.
+ */
+char* sharded_tree_list(ShardedTree* tree, const char* path);
+
+/** See tree_create. */
+int sharded_tree_create(ShardedTree* tree, const char* path);
+
+/** See tree_remove. */
+int sharded_tree_remove(ShardedTree* tree, const char* path);
+
+/**
+ * See tree_move. A move between shards locks the roots of both shards for writing,
+ * see tree_move_across, so it stays atomic, but it stalls every operation on
+ * either shard until it is done.
+ */
+int sharded_tree_move(ShardedTree* tree, const char* source, const char* target);
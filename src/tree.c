@@ -1,16 +1,35 @@
 #include <errno.h>
+#include <stdalign.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include "tree.h"
 #include "hash.h"
+#include "watch.h"
 #include "util/err.h"
 #include "util/paths.h"
 
 /** Error code for an attempt to move a directory to its subdirectory. */
 #define ECYCLE -1
 
+/** Number of folders tree_find searches alone before it starts helper threads. */
+#define FIND_PARALLEL_THRESHOLD 64
+
+/** Max number of threads searching a hierarchy in tree_find. */
+#define FIND_MAX_WORKERS 8
+
+/** Number of children kept in a folder itself, before they are moved to a map. */
+#define INLINE_CHILDREN_COUNT 4
+
+/** Size of a cache line, assumed when laying out folders. */
+#define CACHE_LINE_SIZE 64
+
+/** Inverse of the fraction of live folders below which an arena is given up. */
+#define ARENA_SPARSE_LOAD 4
+
 #define CHECK_PTR(ptr) \
     if (!ptr)          \
         fatal(__FUNCTION__)
@@ -20,35 +39,170 @@
         syserr(__FUNCTION__, err)
 
 #define RETURN_ERR(err) \
-    if (err != 0)          \
+    if (err != 0)       \
         return err
 
-/** Structure representing file hierarchy */
+typedef struct TreeArena TreeArena;
+
+/**
+ * Structure representing file hierarchy. Most folders have only a few children,
+ * which are kept in slots of the folder itself, and a map is allocated only once
+ * they overflow. Fields read on every step of a walk share the first cache line,
+ * while the lock, written by every walk passing through, has a line of its own.
+ */
 struct Tree {
-    HashMap* children; /** Hash map of subtree file hierarchies */
+    alignas(CACHE_LINE_SIZE)
+    _Atomic(Tree*) slots[INLINE_CHILDREN_COUNT]; /** Children while there are few of them, filled in order */
+    _Atomic(uint64_t) filter; /** Bloom filter of names in slots, see hmap_fingerprint */
+    HashMap* children; /** Hash map of subtree file hierarchies, or NULL while slots suffice */
+    char* name; /** Name of the folder inside its parent, borrowed by its map, NULL for the root */
+    _Atomic(TreeWatch*) watchers; /** Watches of the folder, see watch.h */
+
+    alignas(CACHE_LINE_SIZE)
     pthread_rwlock_t lock; /** Lock for readers and writers */
+    TreeArena* arena; /** Block the folder was packed into with its siblings by tree_compact, or NULL */
+};
+
+/**
+ * Block of sibling folders stored next to each other, see tree_compact. Folders
+ * leave it only while their parent is locked for writing, which guards the counter.
+ */
+struct TreeArena {
+    size_t live; /** Number of folders still stored in the block */
+    size_t capacity; /** Number of places in the block */
+    Tree folders[];
 };
 
+/** Iterator over children of a folder, see tree_next_child */
+typedef struct TreeIterator {
+    HashMapIterator map; /** Position in the map, if the folder has one */
+    size_t slot; /** Position in slots otherwise */
+} TreeIterator;
+
+/** Allocates memory for a single folder, aligned to a cache line. */
+static Tree* tree_alloc_folder(void) {
+    Tree* tree = aligned_alloc(CACHE_LINE_SIZE, sizeof(Tree));
+    CHECK_PTR(tree);
+
+    return tree;
+}
+
 /**
- * Creates a new tree with the given children.
- * If @p content is NULL, creates a new hashmap.
- * @param content subdirectories of a folder to create
- * @return allocated tree
+ * Creates an empty folder.
+ * @param name name of the folder, copied, or NULL for a root
+ * @return allocated folder
  */
-static Tree* tree_new_populated(HashMap* content) {
-    Tree* root = malloc(sizeof(Tree));
-    CHECK_PTR(root);
+static Tree* tree_new_folder(const char* name) {
+    Tree* tree = tree_alloc_folder();
+
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i)
+        atomic_init(&tree->slots[i], NULL);
 
-    root->children = (content ? content : hmap_new());
-    CHECK_PTR(root->children);
+    atomic_init(&tree->filter, 0);
+    tree->children = NULL;
+    tree->name = NULL;
+
+    if (name) {
+        tree->name = strdup(name);
+        CHECK_PTR(tree->name);
+    }
 
-    CHECK_ERR(pthread_rwlock_init(&root->lock, NULL));
+    atomic_init(&tree->watchers, NULL);
+    tree->arena = NULL;
+    CHECK_ERR(pthread_rwlock_init(&tree->lock, NULL));
 
-    return root;
+    return tree;
 }
 
 Tree* tree_new() {
-    return tree_new_populated(NULL);
+    return tree_new_folder(NULL);
+}
+
+/** Gives back memory of a folder, which is freed along with the last folder of its arena. */
+static void tree_release(Tree* tree) {
+    TreeArena* arena = tree->arena;
+
+    if (!arena)
+        free(tree);
+    else if (--arena->live == 0)
+        free(arena);
+}
+
+static TreeIterator tree_iterator(Tree* tree) {
+    TreeIterator it = {.slot = 0};
+
+    if (tree->children)
+        it.map = hmap_iterator(tree->children);
+
+    return it;
+}
+
+/**
+ * Sets @p folder and @p child to the next child of @p tree, like hmap_next.
+ * Requires @p tree to be locked. Children created meanwhile may or may not be visited.
+ * @return false if there are no more children
+ */
+static bool tree_next_child(Tree* tree, TreeIterator* it, const char** folder, Tree** child) {
+    if (tree->children) {
+        void* value;
+
+        if (!hmap_next(tree->children, &it->map, folder, &value))
+            return false;
+
+        *child = value;
+        return true;
+    }
+
+    if (it->slot == INLINE_CHILDREN_COUNT)
+        return false;
+
+    Tree* next = atomic_load_explicit(&tree->slots[it->slot++], memory_order_acquire);
+
+    if (!next)
+        return false; // Slots are filled in order.
+
+    *folder = next->name;
+    *child = next;
+    return true;
+}
+
+/** Gives the number of children of a locked @p tree. */
+static size_t tree_children_count(Tree* tree) {
+    if (tree->children)
+        return hmap_size(tree->children);
+
+    size_t count = 0;
+    while (count < INLINE_CHILDREN_COUNT && atomic_load_explicit(&tree->slots[count], memory_order_acquire))
+        count++;
+
+    return count;
+}
+
+/**
+ * Gives an array of names of children of a locked @p tree, which is
+ * valid as long as the tree stays locked. The caller should free the result.
+ * Children created meanwhile are either all included or not at all.
+ * @param tree non-NULL tree
+ * @param count pointer to assign the number of names
+ * @return array of names
+ */
+static const char** tree_children_names(Tree* tree, size_t* count) {
+    if (tree->children)
+        return hmap_keys(tree->children, count);
+
+    const char** names = malloc(INLINE_CHILDREN_COUNT * sizeof(char*));
+    CHECK_PTR(names);
+
+    // Once a slot is seen empty, so are all the later ones at that moment.
+    const char* folder;
+    Tree* child;
+    TreeIterator it = tree_iterator(tree);
+
+    *count = 0;
+    while (tree_next_child(tree, &it, &folder, &child))
+        names[(*count)++] = folder;
+
+    return names;
 }
 
 /**
@@ -56,11 +210,11 @@ Tree* tree_new() {
  * @param parent non-NULL tree
  */
 static void tree_free_children(Tree* parent) {
-    void* child;
+    Tree* child;
     const char* folder;
-    HashMapIterator it = hmap_iterator(parent->children);
+    TreeIterator it = tree_iterator(parent);
 
-    while (hmap_next(parent->children, &it, &folder, &child)) {
+    while (tree_next_child(parent, &it, &folder, &child)) {
         if (child) {
             tree_free(child);
         }
@@ -71,13 +225,16 @@ void tree_free(Tree* tree) {
     if (!tree)
         return;
 
-    if (tree->children) {
-        tree_free_children(tree);
+    tree_free_children(tree);
+
+    if (tree->children)
         hmap_free(tree->children);
-    }
+
+    free(tree->name);
+    watch_list_clear(&tree->watchers);
 
     CHECK_ERR(pthread_rwlock_destroy(&tree->lock));
-    free(tree);
+    tree_release(tree);
 }
 
 /**
@@ -87,199 +244,1451 @@ void tree_free(Tree* tree) {
  * @return child
  */
 static Tree* tree_get_child(Tree* parent, const char* folder) {
-    return hmap_get(parent->children, folder);
+    if (parent->children)
+        return hmap_get(parent->children, folder);
+
+    // Filter bits are set before a slot is filled, as in buckets of a map.
+    uint64_t fingerprint = hmap_fingerprint(folder);
+    if ((atomic_load_explicit(&parent->filter, memory_order_acquire) & fingerprint) != fingerprint)
+        return NULL;
+
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i) {
+        Tree* child = atomic_load_explicit(&parent->slots[i], memory_order_acquire);
+
+        if (!child)
+            return NULL;
+        if (strcmp(child->name, folder) == 0)
+            return child;
+    }
+
+    return NULL;
 }
 
 /**
- * Writes a subtree of @p tree located by path @p path to @p subtree.
- * @param tree non-NULL hierarchy root
+ * Publishes @p child inside @p parent under the name of the child. Requires
+ * @p parent to be locked at least for reading. Slots are claimed in order by CAS,
+ * so a failed CAS reveals a concurrently created child, which is checked for
+ * being a namesake before moving on, just like in buckets of a map.
+ * @param parent non-NULL tree
+ * @param child new child
+ * @return EEXIST if a namesake exists, EAGAIN if all the slots are taken,
+ * so that the parent needs a map, or 0 otherwise
+ */
+static int tree_insert_child(Tree* parent, Tree* child) {
+    if (parent->children)
+        return hmap_insert(parent->children, child->name, child) ? 0 : EEXIST;
+
+    atomic_fetch_or_explicit(&parent->filter, hmap_fingerprint(child->name), memory_order_release);
+
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i) {
+        Tree* seen = NULL;
+
+        if (atomic_compare_exchange_strong_explicit(&parent->slots[i], &seen, child,
+                                                    memory_order_acq_rel, memory_order_acquire))
+            return 0;
+        if (strcmp(seen->name, child->name) == 0)
+            return EEXIST;
+    }
+
+    return EAGAIN;
+}
+
+/** Recomputes the filter of slots of @p tree, which has to be locked for writing. */
+static void tree_refilter(Tree* tree) {
+    uint64_t filter = 0;
+
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i) {
+        Tree* child = atomic_load_explicit(&tree->slots[i], memory_order_relaxed);
+
+        if (child)
+            filter |= hmap_fingerprint(child->name);
+    }
+
+    atomic_store_explicit(&tree->filter, filter, memory_order_relaxed);
+}
+
+/** Moves children of @p tree, locked for writing, from slots to a new map. */
+static void tree_upgrade_children(Tree* tree) {
+    // Names of children outlive their entries, see tree_remove_child and tree_move_child.
+    HashMap* map = hmap_new_borrowing();
+    CHECK_PTR(map);
+
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i) {
+        Tree* child = atomic_exchange_explicit(&tree->slots[i], NULL, memory_order_relaxed);
+
+        if (child)
+            hmap_insert(map, child->name, child);
+    }
+
+    atomic_store_explicit(&tree->filter, 0, memory_order_relaxed);
+    tree->children = map;
+}
+
+/** Moves children of @p tree, locked for writing, from its map back to slots. */
+static void tree_downgrade_children(Tree* tree) {
+    HashMap* map = tree->children;
+    size_t i = 0;
+    void* child;
+    const char* folder;
+    HashMapIterator it = hmap_iterator(map);
+
+    while (hmap_next(map, &it, &folder, &child))
+        atomic_store_explicit(&tree->slots[i++], child, memory_order_relaxed);
+
+    tree->children = NULL;
+    hmap_free(map);
+    tree_refilter(tree);
+}
+
+/**
+ * Checks whether a new child of @p tree would need storage that only
+ * tree_make_room can provide, which requires the tree locked for writing.
+ */
+static bool tree_is_crowded(Tree* tree) {
+    if (tree->children)
+        return hmap_is_crowded(tree->children);
+
+    Tree* last = atomic_load_explicit(&tree->slots[INLINE_CHILDREN_COUNT - 1], memory_order_relaxed);
+    return last != NULL;
+}
+
+/** Grows storage of children of a crowded @p tree, locked for writing. */
+static void tree_make_room(Tree* tree) {
+    if (tree->children)
+        hmap_fit(tree->children);
+    else
+        tree_upgrade_children(tree);
+}
+
+/** Shrinks storage of children of @p tree, locked for writing, to their number. */
+static void tree_fit_children(Tree* tree) {
+    if (!tree->children)
+        return;
+
+    if (hmap_size(tree->children) <= INLINE_CHILDREN_COUNT)
+        tree_downgrade_children(tree);
+    else
+        hmap_fit(tree->children);
+}
+
+/** Replaces @p old child of @p parent, locked for writing, named @p folder with @p copy. */
+static void tree_replace_child(Tree* parent, const char* folder, Tree* old, Tree* copy) {
+    if (parent->children) {
+        hmap_update(parent->children, folder, copy);
+        return;
+    }
+
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i) {
+        if (atomic_load_explicit(&parent->slots[i], memory_order_relaxed) == old)
+            atomic_store_explicit(&parent->slots[i], copy, memory_order_relaxed);
+    }
+}
+
+/**
+ * Unlinks @p child named @p folder from @p parent, locked for writing.
+ * A map left with few children gives way to slots again.
+ */
+static void tree_remove_child(Tree* parent, Tree* child, const char* folder) {
+    if (parent->children) {
+        hmap_remove(parent->children, folder);
+
+        if (hmap_size(parent->children) <= INLINE_CHILDREN_COUNT / 2)
+            tree_downgrade_children(parent);
+
+        return;
+    }
+
+    size_t i = 0;
+    while (atomic_load_explicit(&parent->slots[i], memory_order_relaxed) != child)
+        i++;
+
+    // Slots stay filled in order.
+    for (; i + 1 < INLINE_CHILDREN_COUNT; ++i) {
+        Tree* next = atomic_load_explicit(&parent->slots[i + 1], memory_order_relaxed);
+        atomic_store_explicit(&parent->slots[i], next, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&parent->slots[INLINE_CHILDREN_COUNT - 1], NULL, memory_order_relaxed);
+    tree_refilter(parent);
+}
+
+/** Locks @p tree for writing if @p write, otherwise for reading. */
+static void tree_lock(Tree* tree, bool write) {
+    if (write) {
+        CHECK_ERR(pthread_rwlock_wrlock(&tree->lock));
+    } else {
+        CHECK_ERR(pthread_rwlock_rdlock(&tree->lock));
+    }
+}
+
+static void tree_unlock(Tree* tree) {
+    CHECK_ERR(pthread_rwlock_unlock(&tree->lock));
+}
+
+/**
+ * Moves @p old child of @p parent named @p folder to @p copy, a place of @p arena
+ * or a single allocation if @p arena is NULL, and gives @p old back. Both @p parent
+ * and @p old have to be locked for writing, which waits for operations still
+ * running inside the child. The copy is left unlocked, which is safe as long as
+ * the caller holds @p parent, as no walk can reach the copy before.
+ */
+static void tree_relocate(Tree* parent, const char* folder, Tree* old, Tree* copy, TreeArena* arena) {
+    for (size_t i = 0; i < INLINE_CHILDREN_COUNT; ++i)
+        atomic_init(&copy->slots[i], atomic_load_explicit(&old->slots[i], memory_order_relaxed));
+
+    atomic_init(&copy->filter, atomic_load_explicit(&old->filter, memory_order_relaxed));
+    copy->children = old->children;
+    copy->name = old->name;
+    atomic_init(&copy->watchers, atomic_load_explicit(&old->watchers, memory_order_relaxed));
+    copy->arena = arena;
+    CHECK_ERR(pthread_rwlock_init(&copy->lock, NULL));
+
+    tree_replace_child(parent, folder, old, copy);
+
+    tree_unlock(old);
+    CHECK_ERR(pthread_rwlock_destroy(&old->lock));
+    tree_release(old);
+}
+
+/**
+ * Checks whether @p child, about to leave its parent locked for writing, leaves
+ * behind an arena which is mostly made of dead places.
+ */
+static bool tree_leaves_arena_sparse(Tree* child) {
+    TreeArena* arena = child->arena;
+
+    return arena && arena->live > 1 && (arena->live - 1) * ARENA_SPARSE_LOAD < arena->capacity;
+}
+
+/**
+ * Moves children of @p parent, locked for writing, stored in @p arena to single
+ * allocations, which frees the arena. All the folders of an arena are siblings,
+ * so only @p parent has to be searched. The children are locked for writing, so
+ * the caller must not hold any folder below @p parent, or a walk holding a child
+ * while waiting for that folder would never let go.
+ * @param parent folder whose children to move
+ * @param arena sparse arena of children of @p parent
+ */
+static void tree_unpack_children(Tree* parent, TreeArena* arena) {
+    size_t left = arena->live;
+    Tree* child;
+    const char* folder;
+    TreeIterator it = tree_iterator(parent);
+
+    // The arena is freed along with its last folder, so it is not looked at once empty.
+    while (left > 0 && tree_next_child(parent, &it, &folder, &child)) {
+        if (child->arena != arena)
+            continue;
+
+        left--;
+        tree_lock(child, true);
+        tree_relocate(parent, folder, child, tree_alloc_folder(), NULL);
+    }
+}
+
+/**
+ * Walks from a locked @p from down the path @p path and writes the reached
+ * subtree to @p subtree. A child is always locked before its parent is released,
+ * so no folder can be removed or moved away from under the walk. On success,
+ * @p subtree is locked for writing if @p write and for reading otherwise,
+ * unless it is @p from itself, which stays locked as it was. Locks of the
+ * folders on the way are released, the lock of @p from is released unless
+ * @p keep_from. On error, no lock other than the one of @p from is held.
+ * Recursive watches of the folders locked on the way are added to @p watches.
+ * @param from non-NULL tree locked by the caller
  * @param subtree pointer to assign a founded tree
- * @param path valid and non-NULL target tree location
+ * @param path valid and non-NULL target tree location relative to @p from
+ * @param len length of @p path
+ * @param write should @p subtree be locked for writing?
+ * @param keep_from should @p from stay locked?
+ * @param watches set to collect watches to, or NULL if the caller does not mutate
  * @return error code or zero if none occurred
  */
-static int tree_extract_safe(Tree* tree, Tree** subtree, const char* path) {
-    *subtree = tree;
+static int tree_descend(Tree* from, Tree** subtree, const char* path, size_t len,
+                        bool write, bool keep_from, WatchSet* watches) {
+    Tree* current = from;
     const char* subpath = path;
+    const char* last = path + len - 1; // Final '/' of the path.
     char folder_buf[MAX_FOLDER_NAME_LENGTH + 1];
 
-    while (*subtree && strcmp(subpath, "/") != 0) {
+    while (subpath != last) {
         subpath = split_path(subpath, folder_buf);
+        Tree* next = tree_get_child(current, folder_buf);
+
+        if (next) {
+            tree_lock(next, write && subpath == last);
 
-        CHECK_ERR(pthread_rwlock_rdlock(&(*subtree)->lock));
-        Tree* next_subtree = tree_get_child(*subtree, folder_buf);
-        CHECK_ERR(pthread_rwlock_unlock(&(*subtree)->lock));
+            if (watches)
+                watch_set_collect(watches, &next->watchers, false);
+        }
+
+        if (current != from || !keep_from)
+            tree_unlock(current);
+        if (!next)
+            return ENOENT;
 
-        *subtree = next_subtree;
+        current = next;
     }
 
-    return *subtree ? 0 : ENOENT;
+    *subtree = current;
+    return 0;
+}
+
+/**
+ * Writes a subtree of @p tree located by path @p path to @p subtree,
+ * locked for writing if @p write and for reading otherwise.
+ * @param tree non-NULL hierarchy root
+ * @param subtree pointer to assign a founded tree
+ * @param path valid and non-NULL target tree location
+ * @param len length of @p path
+ * @param write should @p subtree be locked for writing?
+ * @param watches see tree_descend
+ * @return error code or zero if none occurred
+ */
+static int tree_lock_subtree_safe(Tree* tree, Tree** subtree, const char* path, size_t len,
+                                  bool write, WatchSet* watches) {
+    tree_lock(tree, write && len == 1);
+
+    if (watches)
+        watch_set_collect(watches, &tree->watchers, false);
+
+    return tree_descend(tree, subtree, path, len, write, false, watches);
 }
 
-/** See tree_extract_safe. Performs additional path validation */
-static int tree_extract(Tree* tree, Tree** subtree, const char* path) {
-    if (!path || !is_path_valid(path))
+/** See tree_lock_subtree_safe. Performs additional path validation */
+static int tree_lock_subtree(Tree* tree, Tree** subtree,
+                             const char* path, size_t len, bool write) {
+    if (!is_path_valid(path, len))
         return EINVAL;
 
-    return tree_extract_safe(tree, subtree, path);
+    return tree_lock_subtree_safe(tree, subtree, path, len, write, NULL);
 }
 
 /**
  * Writes a parent of a tree located by path @p path to @p parent,
- * preserving child folder name in @p folder.
+ * preserving child folder name in @p folder. The parent is locked for
+ * writing if @p write and for reading otherwise.
  * @param tree non-NULL hierarchy root
  * @param parent pointer to assign a founded parent
  * @param path target tree location
+ * @param len length of @p path
  * @param folder buffer of at least MAX_FOLDER_NAME + 1 size
+ * @param write should @p parent be locked for writing?
+ * @param watches see tree_descend
  * @return error code or zero if none occurred
  */
-static int tree_extract_parent_safe(Tree* tree, Tree** parent,
-                                    const char* path, char* folder) {
-    char* subpath = make_path_to_parent(path, folder);
-    int err = (subpath ? tree_extract_safe(tree, parent, subpath) : EBUSY);
+static int tree_lock_parent(Tree* tree, Tree** parent, const char* path, size_t len,
+                            char* folder, bool write, WatchSet* watches) {
+    if (!is_path_valid(path, len))
+        return EINVAL;
 
-    free(subpath);
+    // The parent path is a prefix of the path, so it does not need a copy.
+    size_t parent_len = parent_path_length(path, len, folder);
 
-    return err;
+    return parent_len ? tree_lock_subtree_safe(tree, parent, path, parent_len, write, watches) : EBUSY;
 }
 
-/** See tree_extract_parent_safe. Performs additional path validation */
-static int tree_extract_parent(Tree* tree, Tree** parent,
-                               const char* path, char* folder) {
-    if (!path || !is_path_valid(path))
-        return EINVAL;
-
-    return tree_extract_parent_safe(tree, parent, path, folder);
+/**
+ * Reports a change to the collected watches, unless the operation failed.
+ * Releases @p watches either way.
+ * @param watches collected watches
+ * @param err error code of the operation
+ * @param type type of the change
+ * @param path changed folder or the source of a move
+ * @param path_len length of @p path
+ * @param target target of a move or NULL
+ * @param target_len length of @p target
+ */
+static void tree_notify(WatchSet* watches, int err, TreeEventType type,
+                        const char* path, size_t path_len, const char* target, size_t target_len) {
+    if (err)
+        watch_set_release(watches);
+    else
+        watch_set_notify(watches, type, path, path_len, target, target_len);
 }
 
 char* tree_list(Tree* tree, const char* path) {
     Tree* subtree;
-    int err = tree_extract(tree, &subtree, path);
+    int err = (path ? tree_lock_subtree(tree, &subtree, path, strlen(path), false) : EINVAL);
 
     if (err != 0)
         return NULL;
 
-    CHECK_ERR(pthread_rwlock_rdlock(&subtree->lock));
-    char* list = make_map_contents_string(subtree->children);
-    CHECK_ERR(pthread_rwlock_unlock(&subtree->lock));
+    size_t count;
+    const char** names = tree_children_names(subtree, &count);
+    char* list = make_contents_string(names, count);
+
+    tree_unlock(subtree);
+    free(names);
+
+    return list;
+}
+
+/** Orders hierarchies by address, the order in which their roots are locked together. */
+static int compare_tree_addresses(const void* p1, const void* p2) {
+    uintptr_t tree1 = (uintptr_t) *(Tree* const*) p1;
+    uintptr_t tree2 = (uintptr_t) *(Tree* const*) p2;
+
+    return (tree1 > tree2) - (tree1 < tree2);
+}
+
+char* tree_list_roots(Tree** trees, size_t count) {
+    Tree** roots = malloc(count * sizeof(Tree*));
+    const char*** names = malloc(count * sizeof(const char**));
+    size_t* counts = malloc(count * sizeof(size_t));
+    size_t total = 0;
+
+    CHECK_PTR(roots);
+    CHECK_PTR(names);
+    CHECK_PTR(counts);
+
+    memcpy(roots, trees, count * sizeof(Tree*));
+    qsort(roots, count, sizeof(Tree*), compare_tree_addresses);
+
+    // Creations publish children with their parent locked for reading, so a listing
+    // holding the roots for reading could see a creation and miss an earlier one.
+    for (size_t i = 0; i < count; ++i)
+        tree_lock(roots[i], true);
+
+    for (size_t i = 0; i < count; ++i) {
+        names[i] = tree_children_names(roots[i], &counts[i]);
+        total += counts[i];
+    }
+
+    const char** all = malloc((total + 1) * sizeof(char*));
+    CHECK_PTR(all);
+
+    for (size_t i = 0, j = 0; i < count; ++i) {
+        memcpy(all + j, names[i], counts[i] * sizeof(char*));
+        j += counts[i];
+    }
+
+    char* list = make_contents_string(all, total);
+
+    for (size_t i = 0; i < count; ++i) {
+        tree_unlock(roots[i]);
+        free(names[i]);
+    }
+
+    free(all);
+    free(counts);
+    free(names);
+    free(roots);
 
     return list;
 }
 
+/** Snapshot of names of children of a folder, see tree_list_names */
+struct TreeListing {
+    atomic_size_t refs; /** Number of holders of the snapshot */
+    size_t count; /** Number of names */
+    TreeName names[]; /** Sorted names, followed by their characters */
+};
+
+static int compare_tree_names(const void* p1, const void* p2) {
+    return strcmp(((const TreeName*) p1)->data, ((const TreeName*) p2)->data);
+}
+
+TreeListing* tree_list_names_n(Tree* tree, const char* path, size_t len) {
+    Tree* subtree;
+    int err = tree_lock_subtree(tree, &subtree, path, len, false);
+
+    if (err != 0)
+        return NULL;
+
+    size_t count;
+    size_t chars = 0; // Including null characters.
+    const char** names = tree_children_names(subtree, &count);
+
+    for (size_t i = 0; i < count; ++i)
+        chars += strlen(names[i]) + 1;
+
+    // Names and their characters share a single allocation with the snapshot.
+    TreeListing* listing = malloc(sizeof(TreeListing) + count * sizeof(TreeName) + chars);
+    CHECK_PTR(listing);
+
+    char* data = (char*) (listing->names + count);
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t length = strlen(names[i]);
+
+        memcpy(data, names[i], length + 1);
+        listing->names[i] = (TreeName){data, length};
+        data += length + 1;
+    }
+
+    tree_unlock(subtree);
+    free(names);
+
+    qsort(listing->names, count, sizeof(TreeName), compare_tree_names);
+    atomic_init(&listing->refs, 1);
+    listing->count = count;
+
+    return listing;
+}
+
+TreeListing* tree_list_names(Tree* tree, const char* path) {
+    return path ? tree_list_names_n(tree, path, strlen(path)) : NULL;
+}
+
+const TreeName* tree_listing_names(const TreeListing* listing, size_t* count) {
+    *count = listing->count;
+    return listing->names;
+}
+
+void tree_listing_retain(TreeListing* listing) {
+    atomic_fetch_add_explicit(&listing->refs, 1, memory_order_relaxed);
+}
+
+void tree_listing_release(TreeListing* listing) {
+    if (listing && atomic_fetch_sub_explicit(&listing->refs, 1, memory_order_acq_rel) == 1)
+        free(listing);
+}
+
 /**
- * Creates a child folder with a given content inside @p parent.
+ * Creates an empty child folder inside @p parent. Requires @p parent to be
+ * locked at least for reading: the child is published with a single CAS
+ * on the children storage, which also detects a concurrently created namesake.
+ * Storage of a crowded parent is resized first if @p exclusive.
  * @param parent non-NULL folder
  * @param folder name of folder to create
- * @param content content of folder to create
- * @return error code or 0 if none occurred
+ * @param exclusive is @p parent locked for writing?
+ * @return error code, EAGAIN if @p parent has to be locked for writing
+ * to make room for the child, or 0 if none occurred
  */
-static int tree_add_child(Tree* parent, const char* folder, HashMap* content) {
+static int tree_add_child(Tree* parent, const char* folder, bool exclusive) {
     if (tree_get_child(parent, folder))
         return EEXIST;
 
-    Tree* child = tree_new_populated(content);
-    hmap_insert(parent->children, folder, child);
+    if (tree_is_crowded(parent)) {
+        if (!exclusive)
+            return EAGAIN;
 
-    return 0;
+        tree_make_room(parent);
+    }
+
+    Tree* child = tree_new_folder(folder);
+    int err = tree_insert_child(parent, child);
+
+    if (err)
+        tree_free(child);
+
+    return err;
 }
 
-int tree_create(Tree* tree, const char* path) {
+/**
+ * Creates a folder @p path in @p tree, see tree_create.
+ * @param tree non-NULL hierarchy root
+ * @param path folder to create
+ * @param len length of @p path
+ * @param exclusive should the parent be locked for writing?
+ * @return error code, EAGAIN if the parent has to be locked for writing,
+ * or zero if none occurred
+ */
+static int tree_create_locked(Tree* tree, const char* path, size_t len, bool exclusive) {
     Tree* parent;
     char folder[MAX_FOLDER_NAME_LENGTH + 1];
-    int err = tree_extract_parent(tree, &parent, path, folder);
+    WatchSet watches = WATCH_SET_EMPTY;
+    int err = tree_lock_parent(tree, &parent, path, len, folder, exclusive, &watches);
 
-    if (err)
+    if (err) {
+        watch_set_release(&watches);
         return err == EBUSY ? EEXIST : err;
+    }
+
+    err = tree_add_child(parent, folder, exclusive);
+
+    if (err == EAGAIN) {
+        watch_set_release(&watches);
+        tree_unlock(parent);
+        return err;
+    }
+
+    // Notifying before the unlock keeps events of a folder in the order of operations.
+    watch_set_collect(&watches, &parent->watchers, true);
+    tree_notify(&watches, err, TREE_EVENT_CREATE, path, len, NULL, 0);
+    tree_unlock(parent);
+
+    return err;
+}
+
+int tree_create_n(Tree* tree, const char* path, size_t len) {
+    int err = tree_create_locked(tree, path, len, false);
 
-    RETURN_ERR(pthread_rwlock_wrlock(&parent->lock));
-    err = tree_add_child(parent, folder, NULL);
-    RETURN_ERR(pthread_rwlock_unlock(&parent->lock));
+    // Resizing children storage requires it exclusively, which is rare enough to walk again.
+    if (err == EAGAIN)
+        err = tree_create_locked(tree, path, len, true);
 
     return err;
 }
 
+int tree_create(Tree* tree, const char* path) {
+    return path ? tree_create_n(tree, path, strlen(path)) : EINVAL;
+}
+
 /**
- * Erases subfolder of @p parent named @p folder.
+ * Erases subfolder of @p parent named @p folder. Requires @p parent to be
+ * locked for writing. The child is locked for writing as well before the
+ * emptiness check, so creations that already entered it are waited for.
+ * Watches of the removed folder are added to @p watches.
  * @param parent non-NULL tree
  * @param folder valid and non-NULL folder name to remove
+ * @param watches set to collect watches to
  * @return error code or 0 if none occurred
  */
-static int tree_erase_child(Tree* parent, const char* folder) {
+static int tree_erase_child(Tree* parent, const char* folder, WatchSet* watches) {
     Tree* child = tree_get_child(parent, folder);
 
     if (!child)
         return ENOENT;
-    if (child->children && hmap_size(child->children) > 0)
+
+    tree_lock(child, true);
+    bool empty = (tree_children_count(child) == 0);
+
+    if (empty)
+        watch_set_collect(watches, &child->watchers, true);
+
+    tree_unlock(child);
+
+    if (!empty)
         return ENOTEMPTY;
 
+    TreeArena* arena = child->arena;
+    bool sparse = tree_leaves_arena_sparse(child);
+
+    tree_remove_child(parent, child, folder);
     tree_free(child);
-    hmap_remove(parent->children, folder);
+
+    if (sparse)
+        tree_unpack_children(parent, arena);
 
     return 0;
 }
 
-int tree_remove(Tree* tree, const char* path) {
+int tree_remove_n(Tree* tree, const char* path, size_t len) {
     Tree* parent;
     char folder[MAX_FOLDER_NAME_LENGTH + 1];
-    RETURN_ERR(tree_extract_parent(tree, &parent, path, folder));
+    WatchSet watches = WATCH_SET_EMPTY;
+    int err = tree_lock_parent(tree, &parent, path, len, folder, true, &watches);
 
-    RETURN_ERR(pthread_rwlock_wrlock(&parent->lock));
-    int err = tree_erase_child(parent, folder);
-    RETURN_ERR(pthread_rwlock_unlock(&parent->lock));
+    if (err) {
+        watch_set_release(&watches);
+        return err;
+    }
+
+    err = tree_erase_child(parent, folder, &watches);
+
+    watch_set_collect(&watches, &parent->watchers, true);
+    tree_notify(&watches, err, TREE_EVENT_REMOVE, path, len, NULL, 0);
+    watch_list_prune(&parent->watchers);
+    tree_unlock(parent);
 
     return err;
 }
 
+int tree_remove(Tree* tree, const char* path) {
+    return path ? tree_remove_n(tree, path, strlen(path)) : EINVAL;
+}
+
 /**
  * Moves a directory named @p source_folder from @p source_parent to
  * a directory named @p target_folder inside @p target_parent hierarchy.
+ * Both parents have to be locked for writing. The moved tree is relinked
+ * rather than copied, so operations already running below it are unaffected.
+ * Only a folder packed by tree_compact and moved to another parent is copied
+ * out of its arena, which keeps arenas made of siblings. If that leaves the arena
+ * sparse, it is given to the caller to unpack with tree_unpack_children once the
+ * target parent is released, as the target may lie below a sibling to be locked.
  * @param source_parent non-NULL tree from where to move the folder
  * @param target_parent non-NULL tree where to move the folder
  * @param source_folder valid and non-NULL folder name to erase
  * @param target_folder valid and non-NULL folder name to insert
+ * @param sparse pointer to assign a sparse arena of @p source_parent to, or NULL
  * @return error code or zero if none occurred
  */
 static int tree_move_child(Tree* source_parent, Tree* target_parent,
-                           const char* source_folder, const char* target_folder) {
+                           const char* source_folder, const char* target_folder,
+                           TreeArena** sparse) {
     bool same_folder = (strcmp(source_folder, target_folder) == 0);
     Tree* source_tree = tree_get_child(source_parent, source_folder);
 
+    *sparse = NULL;
+
     if (!source_tree)
         return ENOENT;
     if (source_parent == target_parent && same_folder)
         return 0;
-    if (tree_add_child(target_parent, target_folder, source_tree->children))
+    if (tree_get_child(target_parent, target_folder))
         return EEXIST;
 
-    source_tree->children = NULL;
-    RETURN_ERR(tree_erase_child(source_parent, source_folder));
+    if (source_tree->arena && source_parent != target_parent) {
+        Tree* copy = tree_alloc_folder();
 
-    return 0;
+        if (tree_leaves_arena_sparse(source_tree))
+            *sparse = source_tree->arena;
+
+        tree_lock(source_tree, true);
+        tree_relocate(source_parent, source_folder, source_tree, copy, NULL);
+        source_tree = copy;
+    }
+
+    // Both parents are held exclusively, and only their holders read names of children.
+    char* name = strdup(target_folder);
+    CHECK_PTR(name);
+
+    tree_remove_child(source_parent, source_tree, source_folder);
+    free(source_tree->name);
+    source_tree->name = name;
+
+    if (tree_is_crowded(target_parent))
+        tree_make_room(target_parent);
+
+    tree_insert_child(target_parent, source_tree);
+
+    return 0;
 }
 
-static int tree_move_non_root(Tree* tree, const char* source, const char* target) {
-    Tree* source_parent, *target_parent;
+/**
+ * Locks for writing the parents of @p source and @p target together with their
+ * lowest common ancestor, which holds off any other walk into the affected part.
+ * Both parents are reached from the ancestor, and as their paths diverge right
+ * below it, locks are always taken downwards and cannot deadlock.
+ */
+static int tree_move_non_root(Tree* tree, const char* source, size_t source_len,
+                              const char* target, size_t target_len) {
+    Tree* ancestor, *source_parent, *target_parent;
     char source_folder[MAX_FOLDER_NAME_LENGTH + 1];
     char target_folder[MAX_FOLDER_NAME_LENGTH + 1];
 
-    RETURN_ERR(tree_extract_parent_safe(tree, &source_parent, source, source_folder));
-    RETURN_ERR(tree_extract_parent_safe(tree, &target_parent, target, target_folder));
+    // All these paths are prefixes of the source or the target.
+    size_t source_parent_len = parent_path_length(source, source_len, source_folder);
+    size_t target_parent_len = parent_path_length(target, target_len, target_folder);
+    size_t ancestor_len = common_path_length(source, source_parent_len, target, target_parent_len);
+
+    // Paths of the parents relative to the ancestor, sharing its final '/'.
+    const char* source_subpath = source + ancestor_len - 1;
+    const char* target_subpath = target + ancestor_len - 1;
+    size_t source_subpath_len = source_parent_len - ancestor_len + 1;
+    size_t target_subpath_len = target_parent_len - ancestor_len + 1;
+
+    WatchSet watches = WATCH_SET_EMPTY;
+    TreeArena* sparse = NULL;
+    int err = tree_lock_subtree_safe(tree, &ancestor, source, ancestor_len, true, &watches);
+
+    if (!err) {
+        err = tree_descend(ancestor, &source_parent, source_subpath, source_subpath_len,
+                           true, true, &watches);
+
+        if (!err) {
+            err = tree_descend(ancestor, &target_parent, target_subpath, target_subpath_len,
+                               true, true, &watches);
+
+            if (!err) {
+                err = tree_move_child(source_parent, target_parent, source_folder, target_folder,
+                                      &sparse);
+
+                watch_set_collect(&watches, &source_parent->watchers, true);
+                watch_set_collect(&watches, &target_parent->watchers, true);
+                bool same_path = (source_len == target_len && memcmp(source, target, source_len) == 0);
+                tree_notify(&watches, err || same_path, TREE_EVENT_MOVE,
+                            source, source_len, target, target_len);
+                watch_list_prune(&source_parent->watchers);
+                watch_list_prune(&target_parent->watchers);
 
-    RETURN_ERR(pthread_rwlock_wrlock(&tree->lock));
-    int err = tree_move_child(source_parent, target_parent, source_folder, target_folder);
-    RETURN_ERR(pthread_rwlock_unlock(&tree->lock));
+                if (target_parent != ancestor)
+                    tree_unlock(target_parent);
+            }
+
+            // Below the ancestor, only the source parent is held by now.
+            if (sparse)
+                tree_unpack_children(source_parent, sparse);
+            if (source_parent != ancestor)
+                tree_unlock(source_parent);
+        }
+
+        tree_unlock(ancestor);
+    }
+
+    watch_set_release(&watches);
 
     return err;
 }
 
-int tree_move(Tree* tree, const char* source, const char* target) {
-    if (!source || !target || !is_path_valid(source) || !is_path_valid(target))
+int tree_move_n(Tree* tree, const char* source, size_t source_len,
+                const char* target, size_t target_len) {
+    if (!is_path_valid(source, source_len) || !is_path_valid(target, target_len))
         return EINVAL;
-    if (strcmp(source, "/") == 0)
+    if (source_len == 1) // Source is "/".
         return EBUSY;
-    if (strcmp(target, "/") == 0)
+    if (target_len == 1) // Target is "/".
         return EEXIST;
-    if (is_subpath(source, target))
+    if (is_subpath(source, source_len, target, target_len))
         return ECYCLE;
 
-    return tree_move_non_root(tree, source, target);
-}
\ No newline at end of file
+    return tree_move_non_root(tree, source, source_len, target, target_len);
+}
+
+int tree_move(Tree* tree, const char* source, const char* target) {
+    if (!source || !target)
+        return EINVAL;
+
+    return tree_move_n(tree, source, strlen(source), target, strlen(target));
+}
+
+int tree_move_across(Tree* source_tree, const char* source, size_t source_len,
+                     Tree* target_tree, const char* target, size_t target_len) {
+    if (source_tree == target_tree)
+        return tree_move_n(source_tree, source, source_len, target, target_len);
+
+    if (!is_path_valid(source, source_len) || !is_path_valid(target, target_len))
+        return EINVAL;
+    if (source_len == 1) // Source is "/".
+        return EBUSY;
+    if (target_len == 1) // Target is "/".
+        return EEXIST;
+
+    Tree* source_parent, *target_parent;
+    char source_folder[MAX_FOLDER_NAME_LENGTH + 1];
+    char target_folder[MAX_FOLDER_NAME_LENGTH + 1];
+    size_t source_parent_len = parent_path_length(source, source_len, source_folder);
+    size_t target_parent_len = parent_path_length(target, target_len, target_folder);
+
+    // Both roots stand for the common ancestor of tree_move_non_root: a parent locked
+    // alone could be moved to the other hierarchy before that one is walked down.
+    // They are locked in the order of their addresses, as in tree_list_roots.
+    Tree* first = ((uintptr_t) source_tree < (uintptr_t) target_tree ? source_tree : target_tree);
+    Tree* second = (first == source_tree ? target_tree : source_tree);
+    WatchSet watches = WATCH_SET_EMPTY;
+    TreeArena* sparse = NULL;
+
+    tree_lock(first, true);
+    tree_lock(second, true);
+    watch_set_collect(&watches, &source_tree->watchers, false);
+    watch_set_collect(&watches, &target_tree->watchers, false);
+
+    int err = tree_descend(source_tree, &source_parent, source, source_parent_len,
+                           true, true, &watches);
+
+    if (!err) {
+        err = tree_descend(target_tree, &target_parent, target, target_parent_len,
+                           true, true, &watches);
+
+        if (!err) {
+            err = tree_move_child(source_parent, target_parent, source_folder, target_folder,
+                                  &sparse);
+
+            watch_set_collect(&watches, &source_parent->watchers, true);
+            watch_set_collect(&watches, &target_parent->watchers, true);
+            tree_notify(&watches, err, TREE_EVENT_MOVE, source, source_len, target, target_len);
+            watch_list_prune(&source_parent->watchers);
+            watch_list_prune(&target_parent->watchers);
+
+            if (target_parent != target_tree)
+                tree_unlock(target_parent);
+        }
+
+        if (sparse)
+            tree_unpack_children(source_parent, sparse);
+        if (source_parent != source_tree)
+            tree_unlock(source_parent);
+    }
+
+    tree_unlock(second);
+    tree_unlock(first);
+    watch_set_release(&watches);
+
+    return err;
+}
+
+TreeWatch* tree_watch_n(Tree* tree, const char* path, size_t len, bool recursive) {
+    Tree* subtree;
+    int err = tree_lock_subtree(tree, &subtree, path, len, true);
+
+    if (err != 0)
+        return NULL;
+
+    // Folders which only get new children are never locked for writing otherwise,
+    // so watches closed there are dropped whenever another one is added.
+    TreeWatch* watch = watch_new(recursive);
+    watch_list_prune(&subtree->watchers);
+    watch_list_push(&subtree->watchers, watch);
+    tree_unlock(subtree);
+
+    return watch;
+}
+
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive) {
+    return path ? tree_watch_n(tree, path, strlen(path), recursive) : NULL;
+}
+
+size_t tree_watch_drain(TreeWatch* watch, TreeEvent* events, size_t count) {
+    return watch_drain(watch, events, count);
+}
+
+void tree_event_free(TreeEvent* event) {
+    watch_event_free(event);
+}
+
+void tree_unwatch(TreeWatch* watch) {
+    if (watch)
+        watch_close(watch);
+}
+
+/**
+ * Adds memory used by a subtree locked by the caller to @p memory.
+ * Descendants are locked for reading one branch at a time.
+ */
+static void tree_memory_subtree(Tree* tree, TreeMemory* memory) {
+    memory->nodes += sizeof(Tree);
+    memory->watches += watch_list_memory(&tree->watchers);
+
+    if (tree->children) {
+        HashMapMemory map = hmap_memory(tree->children);
+        memory->maps += map.table;
+        memory->keys += map.entries;
+    }
+
+    Tree* child;
+    const char* folder;
+    TreeArena* arena = NULL;
+    TreeIterator it = tree_iterator(tree);
+
+    while (tree_next_child(tree, &it, &folder, &child)) {
+        // Names of children are counted here, as they change only with the parent locked.
+        memory->keys += strlen(folder) + 1;
+
+        // Children share at most one arena, whose places are all counted once.
+        if (child->arena && !arena) {
+            arena = child->arena;
+            memory->nodes += sizeof(TreeArena) + (arena->capacity - arena->live) * sizeof(Tree);
+        }
+
+        tree_lock(child, false);
+        tree_memory_subtree(child, memory);
+        tree_unlock(child);
+    }
+}
+
+int tree_memory_n(Tree* tree, const char* path, size_t len, TreeMemory* memory) {
+    Tree* subtree;
+
+    if (!memory)
+        return EINVAL;
+
+    int err = tree_lock_subtree(tree, &subtree, path, len, false);
+    RETURN_ERR(err);
+
+    *memory = (TreeMemory){0, 0, 0, 0};
+    tree_memory_subtree(subtree, memory);
+    tree_unlock(subtree);
+
+    return 0;
+}
+
+int tree_memory(Tree* tree, const char* path, TreeMemory* memory) {
+    return path ? tree_memory_n(tree, path, strlen(path), memory) : EINVAL;
+}
+
+/**
+ * Locks all descendants of a folder locked for writing by the caller for writing
+ * as well, top-down, which waits for operations still running inside.
+ */
+static void tree_compact_lock(Tree* tree) {
+    Tree* child;
+    const char* folder;
+    TreeIterator it = tree_iterator(tree);
+
+    while (tree_next_child(tree, &it, &folder, &child)) {
+        tree_lock(child, true);
+        tree_compact_lock(child);
+    }
+}
+
+/**
+ * Moves children of a folder to consecutive places of a new arena, then does
+ * the same for their children. All the descendants have to be locked for writing
+ * by tree_compact_lock, and the copies are left unlocked, which is safe as long
+ * as the caller holds the folder where the compaction began.
+ * @param tree folder whose children to move
+ */
+static void tree_compact_move(Tree* tree) {
+    Tree* old;
+    const char* folder;
+    TreeArena* arena = NULL;
+    Tree* next = NULL;
+
+    tree_fit_children(tree);
+
+    // Siblings are placed together, as they are usually visited together. Each
+    // arena holds siblings only, so that it can be given up by their parent alone.
+    size_t count = tree_children_count(tree);
+    if (count > 1) {
+        arena = aligned_alloc(CACHE_LINE_SIZE, sizeof(TreeArena) + count * sizeof(Tree));
+        CHECK_PTR(arena);
+
+        arena->live = count;
+        arena->capacity = count;
+        next = arena->folders;
+    }
+
+    TreeIterator it = tree_iterator(tree);
+
+    while (tree_next_child(tree, &it, &folder, &old))
+        tree_relocate(tree, folder, old, arena ? next++ : tree_alloc_folder(), arena);
+
+    it = tree_iterator(tree);
+
+    while (tree_next_child(tree, &it, &folder, &old))
+        tree_compact_move(old);
+}
+
+int tree_compact_n(Tree* tree, const char* path, size_t len) {
+    Tree* subtree;
+    int err = tree_lock_subtree(tree, &subtree, path, len, true);
+    RETURN_ERR(err);
+
+    tree_compact_lock(subtree);
+    tree_compact_move(subtree);
+    tree_unlock(subtree);
+
+    return 0;
+}
+
+int tree_compact(Tree* tree, const char* path) {
+    return path ? tree_compact_n(tree, path, strlen(path)) : EINVAL;
+}
+
+/** Component of a search pattern, see tree_find */
+typedef struct FindComponent {
+    const char* pattern; /** Folder pattern, not null-terminated */
+    size_t length; /** Length of the folder pattern */
+    size_t prefix; /** Length of the literal prefix, see pattern_prefix_length */
+    bool any_depth; /** Is it ANY_DEPTH_PATTERN? */
+} FindComponent;
+
+/**
+ * Set of states of matching a pattern against a path: bit i is set if the path
+ * matches the first i components of the pattern.
+ */
+typedef uint64_t FindStates;
+
+typedef struct FindJob FindJob;
+
+/** Search shared by all the threads taking part in it */
+typedef struct FindContext {
+    FindComponent components[MAX_PATTERN_COMPONENTS];
+    size_t count; /** Number of pattern components */
+    TreeFindCallback callback;
+    void* arg;
+    pthread_mutex_t callback_lock; /** Serializes calls of the callback */
+    atomic_bool stopped; /** Has the callback asked to stop? */
+    atomic_bool truncated; /** Have folders too deep for a path been skipped? */
+    size_t visited; /** Number of folders searched before helpers were started */
+    pthread_t helpers[FIND_MAX_WORKERS - 1];
+    size_t helpers_count; /** Number of started helpers, fixed once they start */
+    atomic_size_t idle; /** Number of helpers waiting for a job */
+    pthread_mutex_t pool_lock; /** Guards the jobs and the end of the search */
+    pthread_cond_t pool_cond; /** Signalled on new jobs, helpers leaving jobs and the end */
+    FindJob* jobs; /** Stack of split folders, whose tasks may not all be taken */
+    bool done; /** Has the search ended, so that helpers should exit? */
+} FindContext;
+
+/** Child folder waiting to be searched by one of the threads */
+typedef struct FindTask {
+    Tree* child;
+    const char* folder;
+    FindStates states;
+} FindTask;
+
+/** Folder split among threads, see find_parallel */
+struct FindJob {
+    FindContext* context;
+    FindTask* tasks;
+    size_t count;
+    atomic_size_t next; /** Index of the first task not taken yet */
+    const char* path; /** Path of the split folder */
+    size_t path_len;
+    FindJob* next_job; /** Job below on the stack of the context */
+    size_t helpers; /** Number of helpers working on the job, guarded by the pool lock */
+};
+
+static FindStates find_bit(size_t i) {
+    return (FindStates) 1 << i;
+}
+
+/** Extends @p states with the states reachable by matching ANY_DEPTH_PATTERN with no folder. */
+static FindStates find_closure(FindContext* context, FindStates states) {
+    for (size_t i = 0; i < context->count; ++i) {
+        if ((states & find_bit(i)) && context->components[i].any_depth)
+            states |= find_bit(i + 1);
+    }
+
+    return states;
+}
+
+/** Gives states of matching a path extended with @p folder. */
+static FindStates find_step(FindContext* context, FindStates states, const char* folder) {
+    FindStates next = 0;
+
+    for (size_t i = 0; i < context->count; ++i) {
+        FindComponent* component = &context->components[i];
+
+        if (!(states & find_bit(i)))
+            continue;
+
+        if (component->any_depth) {
+            next |= find_bit(i);
+        } else if (strncmp(component->pattern, folder, component->prefix) == 0 &&
+                   is_folder_matching(component->pattern, component->length, folder)) {
+            next |= find_bit(i + 1);
+        }
+    }
+
+    return find_closure(context, next);
+}
+
+/**
+ * Checks whether all the pending components of @p states are wildcard-free,
+ * in which case children can be looked up by name instead of being scanned.
+ */
+static bool find_is_literal(FindContext* context, FindStates states) {
+    for (size_t i = 0; i < context->count; ++i) {
+        FindComponent* component = &context->components[i];
+
+        if ((states & find_bit(i)) && component->prefix != component->length)
+            return false; // Also covers ANY_DEPTH_PATTERN.
+    }
+
+    return true;
+}
+
+static void find_report(FindContext* context, const char* path) {
+    CHECK_ERR(pthread_mutex_lock(&context->callback_lock));
+
+    if (!atomic_load_explicit(&context->stopped, memory_order_relaxed) &&
+        context->callback(path, context->arg) != 0)
+        atomic_store_explicit(&context->stopped, true, memory_order_relaxed);
+
+    CHECK_ERR(pthread_mutex_unlock(&context->callback_lock));
+}
+
+static void find_subtree(FindContext* context, Tree* tree, FindStates states,
+                         char* path, size_t path_len);
+
+/**
+ * Searches a child of a folder locked by the caller. The child is locked for
+ * reading for the time of the search, so it cannot change its place meanwhile.
+ * @param path buffer holding the path of the parent
+ * @param path_len length of the path of the parent
+ */
+static void find_child(FindContext* context, Tree* child, const char* folder,
+                       FindStates states, char* path, size_t path_len) {
+    size_t folder_len = strlen(folder);
+
+    // Moves can nest folders deeper than any valid path reaches.
+    if (path_len + folder_len + 1 > MAX_PATH_LENGTH) {
+        atomic_store_explicit(&context->truncated, true, memory_order_relaxed);
+        return;
+    }
+
+    memcpy(path + path_len, folder, folder_len);
+    path[path_len + folder_len] = '/';
+    path[path_len + folder_len + 1] = '\0';
+
+    tree_lock(child, false);
+    find_subtree(context, child, states, path, path_len + folder_len + 1);
+    tree_unlock(child);
+
+    path[path_len] = '\0';
+}
+
+/** Searches children of a folder taken from the job by a single thread. */
+static void* find_worker(void* data) {
+    FindJob* job = data;
+    char path[MAX_PATH_LENGTH + 1];
+    size_t i;
+
+    memcpy(path, job->path, job->path_len + 1);
+
+    while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->count) {
+        FindTask* task = &job->tasks[i];
+        find_child(job->context, task->child, task->folder, task->states, path, job->path_len);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs helpers of a search: each of them waits for a split folder with tasks left,
+ * works on it alongside the thread which split it and then waits for another one.
+ */
+static void* find_helper(void* data) {
+    FindContext* context = data;
+
+    CHECK_ERR(pthread_mutex_lock(&context->pool_lock));
+
+    while (!context->done) {
+        FindJob* job = context->jobs;
+
+        // Jobs whose tasks are all taken are left for their threads to unlink.
+        while (job && atomic_load_explicit(&job->next, memory_order_relaxed) >= job->count)
+            job = job->next_job;
+
+        if (!job) {
+            CHECK_ERR(pthread_cond_wait(&context->pool_cond, &context->pool_lock));
+            continue;
+        }
+
+        job->helpers++;
+        atomic_fetch_sub_explicit(&context->idle, 1, memory_order_relaxed);
+        CHECK_ERR(pthread_mutex_unlock(&context->pool_lock));
+
+        find_worker(job);
+
+        CHECK_ERR(pthread_mutex_lock(&context->pool_lock));
+        atomic_fetch_add_explicit(&context->idle, 1, memory_order_relaxed);
+
+        if (--job->helpers == 0)
+            CHECK_ERR(pthread_cond_broadcast(&context->pool_cond));
+    }
+
+    CHECK_ERR(pthread_mutex_unlock(&context->pool_lock));
+
+    return NULL;
+}
+
+/**
+ * Starts helpers of a search which has turned out to be large, one fewer than
+ * the processors, up to FIND_MAX_WORKERS threads in total.
+ */
+static void find_start_helpers(FindContext* context) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = (processors > 1 ? (size_t) processors - 1 : 0);
+
+    if (count > FIND_MAX_WORKERS - 1)
+        count = FIND_MAX_WORKERS - 1;
+
+    // Helpers find no job before this thread splits a folder, so the count may lag.
+    for (size_t i = 0; i < count; ++i) {
+        atomic_fetch_add_explicit(&context->idle, 1, memory_order_relaxed);
+
+        if (pthread_create(&context->helpers[i], NULL, find_helper, context) != 0) {
+            atomic_fetch_sub_explicit(&context->idle, 1, memory_order_relaxed);
+            break;
+        }
+
+        context->helpers_count++;
+    }
+}
+
+/** Stops helpers of a search, which have no job left, and waits for them. */
+static void find_stop_helpers(FindContext* context) {
+    CHECK_ERR(pthread_mutex_lock(&context->pool_lock));
+    context->done = true;
+    CHECK_ERR(pthread_cond_broadcast(&context->pool_cond));
+    CHECK_ERR(pthread_mutex_unlock(&context->pool_lock));
+
+    for (size_t i = 0; i < context->helpers_count; ++i)
+        CHECK_ERR(pthread_join(context->helpers[i], NULL));
+}
+
+/**
+ * Splits matching children of a folder among the calling thread and idle helpers,
+ * whichever thread reaches the folder and however deep it is, so that large
+ * subtrees are shared even below folders with few children. The folder stays
+ * locked by the calling thread until all the helpers leave, which keeps the
+ * children in place while other threads lock them.
+ * @return false if the folder was not split and has to be searched by the caller
+ */
+static bool find_parallel(FindContext* context, Tree* tree, FindStates states,
+                          char* path, size_t path_len) {
+    size_t capacity = tree_children_count(tree);
+
+    if (capacity < 2 || atomic_load_explicit(&context->idle, memory_order_relaxed) == 0)
+        return false;
+
+    FindJob job = {context, malloc(capacity * sizeof(FindTask)), 0, 0, path, path_len, NULL, 0};
+    CHECK_PTR(job.tasks);
+
+    Tree* child;
+    const char* folder;
+    TreeIterator it = tree_iterator(tree);
+
+    // Children created meanwhile are not needed, as the search is not atomic.
+    while (job.count < capacity && tree_next_child(tree, &it, &folder, &child)) {
+        FindStates next = find_step(context, states, folder);
+
+        if (next)
+            job.tasks[job.count++] = (FindTask){child, folder, next};
+    }
+
+    bool shared = (job.count > 1);
+
+    if (shared) {
+        CHECK_ERR(pthread_mutex_lock(&context->pool_lock));
+        job.next_job = context->jobs;
+        context->jobs = &job;
+        CHECK_ERR(pthread_cond_broadcast(&context->pool_cond));
+        CHECK_ERR(pthread_mutex_unlock(&context->pool_lock));
+    }
+
+    find_worker(&job);
+
+    if (shared) {
+        CHECK_ERR(pthread_mutex_lock(&context->pool_lock));
+
+        FindJob** link = &context->jobs;
+        while (*link != &job)
+            link = &(*link)->next_job;
+        *link = job.next_job;
+
+        while (job.helpers > 0)
+            CHECK_ERR(pthread_cond_wait(&context->pool_cond, &context->pool_lock));
+
+        CHECK_ERR(pthread_mutex_unlock(&context->pool_lock));
+    }
+
+    free(job.tasks);
+
+    return true;
+}
+
+/**
+ * Reports matching folders of a subtree locked by the caller.
+ * @param context search context
+ * @param tree root of the subtree
+ * @param states states of matching the path of @p tree
+ * @param path buffer of MAX_PATH_LENGTH + 1 size holding the path of @p tree
+ * @param path_len length of the path of @p tree
+ */
+static void find_subtree(FindContext* context, Tree* tree, FindStates states,
+                         char* path, size_t path_len) {
+    FindStates final = find_bit(context->count);
+
+    if (atomic_load_explicit(&context->stopped, memory_order_relaxed))
+        return;
+    if (states & final)
+        find_report(context, path);
+
+    // Only the calling thread searches until helpers start, so the count is its own.
+    if (context->helpers_count == 0 && ++context->visited == FIND_PARALLEL_THRESHOLD)
+        find_start_helpers(context);
+    if (!(states & ~final))
+        return; // Nothing deeper can match.
+
+    if (find_is_literal(context, states)) {
+        char folder[MAX_FOLDER_NAME_LENGTH + 1];
+
+        for (size_t i = 0; i < context->count; ++i) {
+            FindComponent* component = &context->components[i];
+
+            if (!(states & find_bit(i)) || component->length > MAX_FOLDER_NAME_LENGTH)
+                continue;
+
+            memcpy(folder, component->pattern, component->length);
+            folder[component->length] = '\0';
+
+            // Several states may expect the same name, the first one covers them all.
+            bool seen = false;
+            for (size_t j = 0; j < i && !seen; ++j) {
+                seen = (states & find_bit(j)) && context->components[j].length == component->length &&
+                       memcmp(context->components[j].pattern, folder, component->length) == 0;
+            }
+
+            Tree* child = (seen ? NULL : tree_get_child(tree, folder));
+            if (child)
+                find_child(context, child, folder, find_step(context, states, folder), path, path_len);
+        }
+
+        return;
+    }
+
+    if (find_parallel(context, tree, states, path, path_len))
+        return;
+
+    Tree* child;
+    const char* folder;
+    TreeIterator it = tree_iterator(tree);
+
+    while (tree_next_child(tree, &it, &folder, &child)) {
+        FindStates next = find_step(context, states, folder);
+
+        if (next)
+            find_child(context, child, folder, next, path, path_len);
+    }
+}
+
+/** Splits a valid pattern into components of @p context. */
+static void find_parse_pattern(FindContext* context, const char* pattern, size_t len) {
+    const char* pattern_end = pattern + len;
+    context->count = 0;
+
+    while (pattern != pattern_end) {
+        if (*pattern == '/') {
+            pattern++;
+            continue;
+        }
+
+        const char* end = memchr(pattern, '/', pattern_end - pattern);
+        size_t length = (end ? end : pattern_end) - pattern;
+
+        context->components[context->count++] = (FindComponent){
+            pattern, length, pattern_prefix_length(pattern, length),
+            length == strlen(ANY_DEPTH_PATTERN) && strncmp(pattern, ANY_DEPTH_PATTERN, length) == 0
+        };
+
+        pattern += length;
+    }
+}
+
+int tree_find_n(Tree* tree, const char* root, size_t root_len, const char* pattern,
+                size_t pattern_len, TreeFindCallback callback, void* arg) {
+    Tree* subtree;
+    FindContext context;
+    char path[MAX_PATH_LENGTH + 1];
+
+    if (!callback || !is_pattern_valid(pattern, pattern_len))
+        return EINVAL;
+
+    int err = tree_lock_subtree(tree, &subtree, root, root_len, false);
+    RETURN_ERR(err);
+
+    find_parse_pattern(&context, pattern, pattern_len);
+    context.callback = callback;
+    context.arg = arg;
+    atomic_init(&context.stopped, false);
+    atomic_init(&context.truncated, false);
+    context.visited = 0;
+    context.helpers_count = 0;
+    atomic_init(&context.idle, 0);
+    context.jobs = NULL;
+    context.done = false;
+    CHECK_ERR(pthread_mutex_init(&context.callback_lock, NULL));
+    CHECK_ERR(pthread_mutex_init(&context.pool_lock, NULL));
+    CHECK_ERR(pthread_cond_init(&context.pool_cond, NULL));
+
+    // The root is not below itself, so it is not reported even if "**" matches it.
+    FindStates states = find_closure(&context, find_bit(0)) & ~find_bit(context.count);
+
+    memcpy(path, root, root_len); // Root is a valid path, so it fits.
+    path[root_len] = '\0';
+    find_subtree(&context, subtree, states, path, root_len);
+    tree_unlock(subtree);
+
+    if (context.helpers_count > 0)
+        find_stop_helpers(&context);
+
+    CHECK_ERR(pthread_cond_destroy(&context.pool_cond));
+    CHECK_ERR(pthread_mutex_destroy(&context.pool_lock));
+    CHECK_ERR(pthread_mutex_destroy(&context.callback_lock));
+
+    return atomic_load_explicit(&context.truncated, memory_order_relaxed) ? ENAMETOOLONG : 0;
+}
+
+int tree_find(Tree* tree, const char* root, const char* pattern,
+              TreeFindCallback callback, void* arg) {
+    if (!root || !pattern)
+        return EINVAL;
+
+    return tree_find_n(tree, root, strlen(root), pattern, strlen(pattern), callback, arg);
+}
@@ -6,8 +6,32 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct Tree Tree;
 
+typedef struct TreeWatch TreeWatch;
+
+/** Kinds of changes reported to watches */
+typedef enum TreeEventType {
+    TREE_EVENT_CREATE, /** A folder was created */
+    TREE_EVENT_REMOVE, /** A folder was removed */
+    TREE_EVENT_MOVE, /** A folder was moved */
+    TREE_EVENT_OVERFLOW /** Some events were dropped, as the buffer of the watch was full */
+} TreeEventType;
+
+/** Change of a file hierarchy */
+typedef struct TreeEvent {
+    TreeEventType type; /** Kind of the change */
+    const char* path; /** Changed folder or source of a move, NULL for an overflow */
+    const char* target; /** Target of a move, NULL otherwise */
+} TreeEvent;
+
 Tree* tree_new();
 
 void tree_free(Tree*);
@@ -22,6 +46,44 @@ void tree_free(Tree*);
  */
 char* tree_list(Tree* tree, const char* path);
 
+/** Name of a folder inside a listing */
+typedef struct TreeName {
+    const char* data; /** Characters of the name, null-terminated as well */
+    size_t length; /** Length of the name */
+} TreeName;
+
+typedef struct TreeListing TreeListing;
+
+/**
+ * Takes a snapshot of names of children of a folder under a given path, like
+ * tree_list, but leaves them apart instead of joining them. The names share
+ * a single allocation, which lives as long as anyone holds the snapshot.
+ * @param tree file hierarchy
+ * @param path folder, content of which to list
+ * @return snapshot held by the caller, or NULL if @p path is NULL, invalid or does not exist
+ */
+TreeListing* tree_list_names(Tree* tree, const char* path);
+
+/**
+ * Gives names of a snapshot, lexicographically sorted.
+ * @param listing snapshot
+ * @param count pointer to assign the number of names
+ * @return array of names valid as long as @p listing
+ */
+const TreeName* tree_listing_names(const TreeListing* listing, size_t* count);
+
+/**
+ * Adds a holder of a snapshot.
+ * @param listing snapshot
+ */
+void tree_listing_retain(TreeListing* listing);
+
+/**
+ * Drops a holder of a snapshot, freeing it once there are none left.
+ * @param listing snapshot or NULL
+ */
+void tree_listing_release(TreeListing* listing);
+
 /**
  * Creates a folder @p path in @p tree. Returns:
  * EINVAL - @p path NULL or invalid (see is_path_valid in src/util/paths.c);
@@ -60,4 +122,178 @@ int tree_remove(Tree* tree, const char* path);
  * @param target where to move folder
  * @return error code or zero if none occurred
  */
-int tree_move(Tree* tree, const char* source, const char* target);
\ No newline at end of file
+int tree_move(Tree* tree, const char* source, const char* target);
+
+/**
+ * Lists the root folders of several hierarchies together, as if they were
+ * a single folder, see tree_list. The roots are locked together for writing,
+ * in the order of their addresses, so the listing is atomic with respect to other
+ * operations on these hierarchies, creations included, as well as tree_move_across.
+ * Meanwhile, no operation on these hierarchies can start.
+ * @param trees distinct file hierarchies
+ * @param count number of @p trees
+ * @return content of the roots of @p trees
+ */
+char* tree_list_roots(Tree** trees, size_t count);
+
+/**
+ * Moves a folder @p source of @p source_tree to @p target of @p target_tree,
+ * atomically with respect to operations on both hierarchies. The roots of both
+ * are locked for writing, in the order of their addresses, as tree_move locks the
+ * common ancestor of its folders, so concurrent moves in opposite directions do not
+ * deadlock. Error codes are the same as of tree_move, which is called if the
+ * hierarchies are the same. Paths do not have to be null-terminated.
+ * @param source_tree hierarchy to move the folder from
+ * @param source folder to move
+ * @param source_len length of @p source
+ * @param target_tree hierarchy to move the folder to
+ * @param target where to move folder
+ * @param target_len length of @p target
+ * @return error code or zero if none occurred
+ */
+int tree_move_across(Tree* source_tree, const char* source, size_t source_len,
+                     Tree* target_tree, const char* target, size_t target_len);
+
+/**
+ * Callback receiving folders found by tree_find.
+ * @param path found folder
+ * @param arg argument given to tree_find
+ * @return zero to continue the search, anything else to stop it
+ */
+typedef int (*TreeFindCallback)(const char* path, void* arg);
+
+/**
+ * Passes to @p callback every folder below @p root whose path relative to @p root
+ * matches @p pattern (see is_pattern_valid in src/util/paths.c). For example,
+ * "*" matches children of @p root, "a/job*" matches folders named job-something
+ * inside its child "a", and with "**" in front of "job*" they may be at any depth.
+ * @p root itself is never reported, not even for "**". Large searches are shared
+ * among several threads, so folders are reported in no particular order, though
+ * never concurrently.
+ * The search is not atomic: folders created, removed or moved during the call
+ * may or may not be reported, others are reported exactly once. Each folder stays
+ * locked for reading until its whole subtree is searched, calls of @p callback
+ * included, so @p callback must not modify @p tree, and removals and moves of
+ * folders in @p root wait for the search to leave them. Returns:
+ * EINVAL - @p root or @p pattern NULL or invalid, or @p callback NULL;
+ * ENOENT - @p root does not exist;
+ * ENAMETOOLONG - some folders were not searched, as their paths would be longer
+ * than MAX_PATH_LENGTH, which moves can lead to; all the others were;
+ * 0 - otherwise;
+ * @param tree file hierarchy
+ * @param root folder to search in
+ * @param pattern pattern of paths relative to @p root
+ * @param callback function to call for each found folder
+ * @param arg argument to pass to @p callback
+ * @return error code or zero if none occurred
+ */
+int tree_find(Tree* tree, const char* root, const char* pattern,
+              TreeFindCallback callback, void* arg);
+
+/** Memory used by a part of a file hierarchy, in bytes */
+typedef struct TreeMemory {
+    size_t nodes; /** Folder structures, with dead places of blocks made by tree_compact */
+    size_t maps; /** Children maps with their bucket tables and filters */
+    size_t keys; /** Map entries and folder names */
+    size_t watches; /** Watches with their event buffers */
+} TreeMemory;
+
+/**
+ * Writes to @p memory the number of bytes used by a folder @p path and all its
+ * descendants. Like tree_find, it is not atomic with respect to concurrent
+ * changes of the subtree. Returns:
+ * EINVAL - @p path NULL or invalid, or @p memory NULL;
+ * ENOENT - @p path does not exist;
+ * 0 - otherwise;
+ * @param tree file hierarchy
+ * @param path folder to measure
+ * @param memory structure to fill
+ * @return error code or zero if none occurred
+ */
+int tree_memory(Tree* tree, const char* path, TreeMemory* memory);
+
+/**
+ * Packs the children of every folder of the subtree @p path next to each other,
+ * in one block per folder, and shrinks their children maps to fit. Maps shrink
+ * on their own as folders are removed, but folders created over time stay
+ * scattered across the heap; this is worth calling once a large directory has
+ * settled. Once most folders of a block are removed or moved elsewhere, the rest
+ * are copied out and the block is freed. The folder itself stays where it is.
+ * The subtree is locked for writing for the time of the call. Returns:
+ * EINVAL - @p path NULL or invalid;
+ * ENOENT - @p path does not exist;
+ * 0 - otherwise;
+ * @param tree file hierarchy
+ * @param path folder to compact
+ * @return error code or zero if none occurred
+ */
+int tree_compact(Tree* tree, const char* path);
+
+/**
+ * Starts watching a folder @p path in @p tree. A watch receives events about
+ * creations, removals and moves of the folder's children, or of all its
+ * descendants if @p recursive. Removing the watched folder itself is reported
+ * as well, after which the watch receives nothing more. The watch follows the
+ * folder when it is moved. Mutations pay for the watches only if there are any
+ * along their paths. Returns NULL if @p path is NULL, invalid or does not exist.
+ * @param tree file hierarchy
+ * @param path folder to watch
+ * @param recursive should events of the whole subtree be reported?
+ * @return watch to drain and eventually pass to tree_unwatch
+ */
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive);
+
+/**
+ * Moves up to @p count pending events of @p watch to @p events, oldest first.
+ * If the watch has overflowed, TREE_EVENT_OVERFLOW follows the last event buffered
+ * before the first lost one: some changes were lost and the folder should be listed
+ * again. Events have to be released with tree_event_free. Their paths may be
+ * shared with events of other watches.
+ * Must not be called concurrently for the same watch.
+ * @param watch watch to drain
+ * @param events buffer for the events
+ * @param count size of @p events
+ * @return number of events written
+ */
+size_t tree_watch_drain(TreeWatch* watch, TreeEvent* events, size_t count);
+
+/**
+ * Releases memory of paths of an event.
+ * @param event drained event
+ */
+void tree_event_free(TreeEvent* event);
+
+/**
+ * Stops a watch and discards its pending events.
+ * @param watch watch created by tree_watch
+ */
+void tree_unwatch(TreeWatch* watch);
+
+/*
+ * Variants of the functions above taking paths and patterns of given lengths,
+ * which do not have to be null-terminated, so that parts of larger strings can be
+ * passed without a copy. They behave exactly as their counterparts, though a NULL
+ * path is only accepted along with zero length.
+ */
+
+TreeListing* tree_list_names_n(Tree* tree, const char* path, size_t len);
+
+int tree_create_n(Tree* tree, const char* path, size_t len);
+
+int tree_remove_n(Tree* tree, const char* path, size_t len);
+
+int tree_move_n(Tree* tree, const char* source, size_t source_len,
+                const char* target, size_t target_len);
+
+int tree_find_n(Tree* tree, const char* root, size_t root_len, const char* pattern,
+                size_t pattern_len, TreeFindCallback callback, void* arg);
+
+int tree_memory_n(Tree* tree, const char* path, size_t len, TreeMemory* memory);
+
+int tree_compact_n(Tree* tree, const char* path, size_t len);
+
+TreeWatch* tree_watch_n(Tree* tree, const char* path, size_t len, bool recursive);
+
+#ifdef __cplusplus
+}
+#endif
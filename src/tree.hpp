@@ -0,0 +1,268 @@
+/** @file
+ * C++17 interface of file hierarchy, see tree.h.
+ * Paths are taken as std::string_view and passed on without copying,
+ * and listings borrow their names from shared snapshots.
+ * Errors are reported with the same codes as by the C interface.
+ * @date 2022
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "tree.h"
+
+namespace file_manager {
+
+/** Sorted names of children of a folder, a range of std::string_view */
+class Listing {
+public:
+    /** Iterator over names of a listing */
+    class iterator {
+    public:
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = std::string_view;
+        // Names are given by value, which forward iterators may not do.
+        using iterator_category = std::input_iterator_tag;
+
+        iterator() = default;
+
+        explicit iterator(const TreeName* name) noexcept : name_(name) {}
+
+        std::string_view operator*() const noexcept {
+            return {name_->data, name_->length};
+        }
+
+        iterator& operator++() noexcept {
+            ++name_;
+            return *this;
+        }
+
+        iterator operator++(int) noexcept {
+            iterator old = *this;
+            ++name_;
+            return old;
+        }
+
+        bool operator==(const iterator& other) const noexcept {
+            return name_ == other.name_;
+        }
+
+        bool operator!=(const iterator& other) const noexcept {
+            return name_ != other.name_;
+        }
+
+    private:
+        const TreeName* name_ = nullptr;
+    };
+
+    /** Creates an invalid listing, standing for an error */
+    Listing() = default;
+
+    /** Takes over a snapshot held by the caller, see tree_list_names */
+    explicit Listing(TreeListing* listing) noexcept : listing_(listing) {
+        if (listing_)
+            names_ = tree_listing_names(listing_, &count_);
+    }
+
+    Listing(const Listing& other) noexcept
+        : listing_(other.listing_), names_(other.names_), count_(other.count_) {
+        if (listing_)
+            tree_listing_retain(listing_);
+    }
+
+    Listing(Listing&& other) noexcept
+        : listing_(std::exchange(other.listing_, nullptr)),
+          names_(std::exchange(other.names_, nullptr)),
+          count_(std::exchange(other.count_, 0)) {}
+
+    Listing& operator=(Listing other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~Listing() {
+        tree_listing_release(listing_);
+    }
+
+    void swap(Listing& other) noexcept {
+        std::swap(listing_, other.listing_);
+        std::swap(names_, other.names_);
+        std::swap(count_, other.count_);
+    }
+
+    /** Checks whether the folder was listed successfully */
+    explicit operator bool() const noexcept {
+        return listing_ != nullptr;
+    }
+
+    iterator begin() const noexcept {
+        return iterator(names_);
+    }
+
+    iterator end() const noexcept {
+        return iterator(names_ + count_);
+    }
+
+    std::size_t size() const noexcept {
+        return count_;
+    }
+
+    bool empty() const noexcept {
+        return count_ == 0;
+    }
+
+    std::string_view operator[](std::size_t i) const noexcept {
+        return {names_[i].data, names_[i].length};
+    }
+
+private:
+    TreeListing* listing_ = nullptr;
+    const TreeName* names_ = nullptr;
+    std::size_t count_ = 0;
+};
+
+/** Watch of a folder, see tree_watch. Only one thread may drain it at a time. */
+class Watch {
+public:
+    /** Creates an invalid watch, standing for an error */
+    Watch() = default;
+
+    /** Takes over a watch created by tree_watch */
+    explicit Watch(TreeWatch* watch) noexcept : watch_(watch) {}
+
+    Watch(const Watch&) = delete;
+    Watch& operator=(const Watch&) = delete;
+
+    Watch(Watch&& other) noexcept : watch_(std::exchange(other.watch_, nullptr)) {}
+
+    Watch& operator=(Watch&& other) noexcept {
+        std::swap(watch_, other.watch_);
+        return *this;
+    }
+
+    ~Watch() {
+        tree_unwatch(watch_);
+    }
+
+    explicit operator bool() const noexcept {
+        return watch_ != nullptr;
+    }
+
+    /** See tree_watch_drain. Events have to be released with tree_event_free. */
+    std::size_t drain(TreeEvent* events, std::size_t count) {
+        return tree_watch_drain(watch_, events, count);
+    }
+
+private:
+    TreeWatch* watch_ = nullptr;
+};
+
+/**
+ * Owning handle of a file hierarchy. Handles can be moved but not copied,
+ * and a moved-from handle may only be destroyed or assigned to.
+ */
+class Tree {
+public:
+    Tree() : tree_(tree_new()) {}
+
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+
+    Tree(Tree&& other) noexcept : tree_(std::exchange(other.tree_, nullptr)) {}
+
+    Tree& operator=(Tree&& other) noexcept {
+        std::swap(tree_, other.tree_);
+        return *this;
+    }
+
+    ~Tree() {
+        tree_free(tree_);
+    }
+
+    /** Underlying hierarchy, still owned by the handle */
+    ::Tree* get() const noexcept {
+        return tree_;
+    }
+
+    /** See tree_list_names. The listing is invalid on error. */
+    Listing list(std::string_view path) const {
+        return Listing(tree_list_names_n(tree_, path.data(), path.size()));
+    }
+
+    /** See tree_create */
+    int create(std::string_view path) {
+        return tree_create_n(tree_, path.data(), path.size());
+    }
+
+    /** See tree_remove */
+    int remove(std::string_view path) {
+        return tree_remove_n(tree_, path.data(), path.size());
+    }
+
+    /** See tree_move */
+    int move(std::string_view source, std::string_view target) {
+        return tree_move_n(tree_, source.data(), source.size(), target.data(), target.size());
+    }
+
+    /**
+     * See tree_find. @p callback receives found paths as std::string_view
+     * and returns whether the search should go on. An exception thrown by
+     * @p callback stops the search and is rethrown once all locks are released.
+     */
+    template <typename Callback>
+    int find(std::string_view root, std::string_view pattern, Callback&& callback) const {
+        using Function = std::remove_reference_t<Callback>;
+
+        struct Closure {
+            Function* callback;
+            std::exception_ptr error;
+        } closure = {&callback, nullptr};
+
+        TreeFindCallback trampoline = [](const char* path, void* arg) -> int {
+            Closure* closure = static_cast<Closure*>(arg);
+
+            try {
+                return (*closure->callback)(std::string_view(path)) ? 0 : 1;
+            } catch (...) {
+                closure->error = std::current_exception();
+                return 1;
+            }
+        };
+
+        int err = tree_find_n(tree_, root.data(), root.size(), pattern.data(), pattern.size(),
+                              trampoline, &closure);
+
+        if (closure.error)
+            std::rethrow_exception(closure.error);
+
+        return err;
+    }
+
+    /** See tree_watch. The watch is invalid on error. */
+    Watch watch(std::string_view path, bool recursive) {
+        return Watch(tree_watch_n(tree_, path.data(), path.size(), recursive));
+    }
+
+    /** See tree_memory */
+    int memory(std::string_view path, TreeMemory& memory) const {
+        return tree_memory_n(tree_, path.data(), path.size(), &memory);
+    }
+
+    /** See tree_compact */
+    int compact(std::string_view path) {
+        return tree_compact_n(tree_, path.data(), path.size());
+    }
+
+private:
+    ::Tree* tree_;
+};
+
+} // namespace file_manager
@@ -4,9 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-bool is_path_valid(const char* path) {
-    size_t len = strlen(path);
-
+bool is_path_valid(const char* path, size_t len) {
     if (len == 0 || len > MAX_PATH_LENGTH)
         return false;
     if (path[0] != '/' || path[len - 1] != '/')
@@ -14,7 +12,8 @@ bool is_path_valid(const char* path) {
 
     const char* name_start = path + 1; // Start of current path component, just after '/'.
     while (name_start < path + len) {
-        char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
+        // End of current path component, at '/'.
+        const char* name_end = memchr(name_start, '/', path + len - name_start);
         if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
             return false;
 
@@ -28,6 +27,67 @@ bool is_path_valid(const char* path) {
     return true;
 }
 
+bool is_pattern_valid(const char* pattern, size_t len) {
+    size_t components = 0;
+
+    if (len == 0 || len > MAX_PATH_LENGTH)
+        return false;
+
+    const char* name_start = (pattern[0] == '/' ? pattern + 1 : pattern);
+    while (name_start < pattern + len) {
+        const char* name_end = memchr(name_start, '/', pattern + len - name_start); // End of current component.
+        if (!name_end)
+            name_end = pattern + len;
+        if (name_end == name_start || ++components > MAX_PATTERN_COMPONENTS)
+            return false;
+
+        for (const char* p = name_start; p != name_end; ++p) {
+            if ((*p < 'a' || *p > 'z') && *p != '*' && *p != '?')
+                return false;
+        }
+
+        name_start = name_end + 1;
+    }
+
+    return components > 0;
+}
+
+size_t pattern_prefix_length(const char* pattern, size_t len) {
+    size_t prefix = 0;
+
+    while (prefix < len && pattern[prefix] != '*' && pattern[prefix] != '?')
+        prefix++;
+
+    return prefix;
+}
+
+bool is_folder_matching(const char* pattern, size_t len, const char* folder) {
+    const char* end = pattern + len;
+    const char* star = NULL; // Position just after the last '*' seen.
+    const char* star_folder = NULL; // Folder position the last '*' is matched up to.
+
+    while (*folder) {
+        if (pattern != end && (*pattern == '?' || *pattern == *folder)) {
+            pattern++;
+            folder++;
+        } else if (pattern != end && *pattern == '*') {
+            star = ++pattern;
+            star_folder = folder;
+        } else if (star) {
+            // Let the last '*' swallow one more letter and retry.
+            pattern = star;
+            folder = ++star_folder;
+        } else {
+            return false;
+        }
+    }
+
+    while (pattern != end && *pattern == '*')
+        pattern++;
+
+    return pattern == end;
+}
+
 const char* split_path(const char* path, char* component) {
     const char* subpath = strchr(path + 1, '/'); // Pointer to second '/' character.
 
@@ -44,32 +104,31 @@ const char* split_path(const char* path, char* component) {
     return subpath;
 }
 
-bool is_subpath(const char* subpath, const char* path) {
-    char folder[MAX_FOLDER_NAME_LENGTH + 1];
-    char subfolder[MAX_FOLDER_NAME_LENGTH + 1];
+bool is_subpath(const char* subpath, size_t subpath_len, const char* path, size_t path_len) {
+    // Both paths end with '/', so a shorter prefix always ends at a folder boundary.
+    return subpath_len < path_len && memcmp(subpath, path, subpath_len) == 0;
+}
 
-    do {
-        path = split_path(path, folder);
-        subpath = split_path(subpath, subfolder);
-    } while (subpath && path && strcmp(folder, subfolder) == 0);
+size_t common_path_length(const char* path1, size_t len1, const char* path2, size_t len2) {
+    size_t length = 0; // Length of the matched prefix ending with '/'.
 
-    return path && !subpath;
-}
+    for (size_t i = 0; i < len1 && i < len2 && path1[i] == path2[i]; ++i) {
+        if (path1[i] == '/')
+            length = i + 1;
+    }
 
-char* make_path_to_parent(const char* path, char* component) {
-    size_t len = strlen(path);
+    return length;
+}
 
+size_t parent_path_length(const char* path, size_t len, char* component) {
     if (len == 1) // Path is "/".
-        return NULL;
+        return 0;
 
     const char* p = path + len - 2; // Point before final '/' character.
     while (*p != '/')  // Move p to last-but-one '/' character.
         p--;
 
     size_t subpath_len = p - path + 1; // Include '/' at p.
-    char* result = malloc(subpath_len + 1); // Include terminating null character.
-    strncpy(result, path, subpath_len);
-    result[subpath_len] = '\0';
 
     if (component) {
         size_t component_len = len - subpath_len - 1; // Skip final '/' as well.
@@ -78,50 +137,33 @@ char* make_path_to_parent(const char* path, char* component) {
         component[component_len] = '\0';
     }
 
-    return result;
+    return subpath_len;
 }
 
 static int compare_string_pointers(const void* p1, const void* p2) {
     return strcmp(*(const char**) p1, *(const char**) p2);
 }
 
-const char** make_map_contents_array(HashMap* map) {
-    size_t keys_count = hmap_size(map);
-    const char** result = calloc(keys_count + 1, sizeof(char*));
-    HashMapIterator it = hmap_iterator(map);
-    const char** key = result;
-    void* value = NULL;
-
-    while (hmap_next(map, &it, key, &value)) {
-        key++;
-    }
-
-    *key = NULL; // Set last array element to NULL.
-    qsort(result, keys_count, sizeof(char*), compare_string_pointers);
-
-    return result;
-}
-
-char* make_map_contents_string(HashMap* map) {
-    const char** keys = make_map_contents_array(map);
+char* make_contents_string(const char** names, size_t count) {
     unsigned int result_size = 0; // Including ending null character.
 
-    for (const char** key = keys; *key; ++key)
-        result_size += strlen(*key) + 1;
+    qsort(names, count, sizeof(char*), compare_string_pointers);
+
+    for (size_t i = 0; i < count; ++i)
+        result_size += strlen(names[i]) + 1;
 
-    // Return empty string if map is empty.
+    // Return empty string if there are no names.
     if (!result_size) {
         // Note we can't just return "", as it can't be free'd.
         char* result = malloc(1);
         *result = '\0';
-        free(keys);
         return result;
     }
 
     char* result = malloc(result_size);
     char* position = result;
 
-    for (const char** key = keys; *key; ++key) {
+    for (const char** key = names; key != names + count; ++key) {
         size_t keylen = strlen(*key);
         assert(position + keylen <= result + result_size);
         strcpy(position, *key); // NOLINT: array size already checked.
@@ -132,7 +174,6 @@ char* make_map_contents_string(HashMap* map) {
 
     position--;
     *position = '\0';
-    free(keys);
 
     return result;
 }
\ No newline at end of file
@@ -6,8 +6,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
-#include "../hash.h"
 
 /** Max length of path (excluding terminating null character) */
 #define MAX_PATH_LENGTH 4095
@@ -15,55 +15,97 @@
 /** Max length of folder name (excluding terminating null character) */
 #define MAX_FOLDER_NAME_LENGTH 255
 
+/** Max number of components of a search pattern */
+#define MAX_PATTERN_COMPONENTS 63
+
+/** Search pattern component matching any number of nested folders */
+#define ANY_DEPTH_PATTERN "**"
+
 /**
  * Checks if given a sequence represents a valid path.
  * Valid paths are '/'-separated sequences of folder names, always starting and ending with '/'.
  * Valid paths have length at most MAX_PATH_LENGTH (and at least 1). Valid folder names are are
  * sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
- * @param path path to validate
+ * @param path path to validate, not necessarily null-terminated
+ * @param len length of @p path
  * @return is path valid?
  */
-bool is_path_valid(const char* path);
+bool is_path_valid(const char* path, size_t len);
+
+/**
+ * Checks if a given sequence represents a valid search pattern.
+ * Valid patterns are '/'-separated sequences of folder patterns, optionally starting and
+ * ending with '/', of length at most MAX_PATH_LENGTH and at most MAX_PATTERN_COMPONENTS
+ * components. A folder pattern is either ANY_DEPTH_PATTERN or a non-empty sequence of
+ * 'a'-'z' ASCII characters, '*' (any sequence of letters) and '?' (any letter).
+ * @param pattern pattern to validate, not necessarily null-terminated
+ * @param len length of @p pattern
+ * @return is pattern valid?
+ */
+bool is_pattern_valid(const char* pattern, size_t len);
+
+/**
+ * Gives the number of leading characters of a folder pattern without wildcards.
+ * @param pattern valid folder pattern, not necessarily null-terminated
+ * @param len length of @p pattern
+ * @return length of the literal prefix of @p pattern
+ */
+size_t pattern_prefix_length(const char* pattern, size_t len);
+
+/**
+ * Checks whether a folder name matches a folder pattern.
+ * @param pattern valid folder pattern other than ANY_DEPTH_PATTERN, not necessarily null-terminated
+ * @param len length of @p pattern
+ * @param folder valid folder name
+ * @return does @p folder match @p pattern?
+ */
+bool is_folder_matching(const char* pattern, size_t len, const char* folder);
 
 /**
- * Checks whether a path is a subpath.
- * @param subpath valid candidate for subpath
- * @param path valid source paths
+ * Checks whether a path is a subpath, that is whether @p path lies strictly inside @p subpath.
+ * @param subpath valid candidate for subpath, not necessarily null-terminated
+ * @param subpath_len length of @p subpath
+ * @param path valid source path, not necessarily null-terminated
+ * @param path_len length of @p path
  * @return is @p subpath a subpath of @p path?
  */
-bool is_subpath(const char* subpath, const char* path);
+bool is_subpath(const char* subpath, size_t subpath_len, const char* path, size_t path_len);
 
 /**
  * Gives the subpath obtained by removing the first component.
- * @param path valid path to split
+ * @param path valid path other than "/" to split, not necessarily null-terminated
  * @param component buffer to store removed component
  * @return @p path without first component
  */
 const char* split_path(const char* path, char* component);
 
 /**
- * Gives a copy of the subpath obtained by removing the last component.
- * The caller should free the result, unless it is NULL.
- * @param path path valid path to split
- * @param component component buffer to store removed component
- * @return @p path without last component
+ * Gives the length of the longest common ancestor path of two paths.
+ * For example, for "/a/b/" and "/a/c/d/" the result is 3, the length of "/a/".
+ * @param path1 valid path, not necessarily null-terminated
+ * @param len1 length of @p path1
+ * @param path2 valid path, not necessarily null-terminated
+ * @param len2 length of @p path2
+ * @return length of the common prefix of @p path1 and @p path2, which is a path itself
  */
-char* make_path_to_parent(const char* path, char* component);
+size_t common_path_length(const char* path1, size_t len1, const char* path2, size_t len2);
 
 /**
- * Return an array containing all keys, lexicographically sorted.
- * The result is null-terminated. *Keys are not copied,
- * they are only valid as long as the map. The caller should free the result.
- * @param map source of keys
- * @return buffer with sorted keys of @p map
+ * Gives the length of the subpath obtained by removing the last component,
+ * which is a prefix of the path itself.
+ * @param path valid path to split, not necessarily null-terminated
+ * @param len length of @p path
+ * @param component buffer to store removed component
+ * @return length of @p path without last component, or 0 if @p path is "/"
  */
-const char** make_map_contents_array(HashMap* map);
+size_t parent_path_length(const char* path, size_t len, char* component);
 
 /**
- * Gives a string containing all keys in map, sorted, comma-separated.
- * The result has no trailing comma. An empty map yields an empty string.
+ * Sorts names lexicographically and gives a string containing them, comma-separated.
+ * The result has no trailing comma. No names yield an empty string.
  * The caller should free the result.
- * @param map source of keys
- * @return sequence of formatted keys
+ * @param names array of @p count names, sorted in place
+ * @param count number of names
+ * @return sequence of formatted names
  */
-char* make_map_contents_string(HashMap* map);
\ No newline at end of file
+char* make_contents_string(const char** names, size_t count);
\ No newline at end of file
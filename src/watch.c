@@ -0,0 +1,339 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "watch.h"
+#include "util/err.h"
+
+/** Slot of a ring buffer, see watch_push */
+typedef struct WatchSlot {
+    atomic_size_t sequence; // Position the slot is ready to be written (or read) at.
+    TreeEvent event;
+} WatchSlot;
+
+/** Paths of an event, shared by all the watches it is pushed to */
+typedef struct WatchPaths {
+    atomic_size_t refs; // Watches still buffering the event and consumers holding it.
+    char chars[]; // Path followed by the target, both null-terminated.
+} WatchPaths;
+
+static void watch_paths_release(WatchPaths* paths) {
+    if (atomic_fetch_sub_explicit(&paths->refs, 1, memory_order_acq_rel) == 1)
+        free(paths);
+}
+
+/** No events have been dropped, see TreeWatch.overflow_pos */
+#define NO_OVERFLOW SIZE_MAX
+
+struct TreeWatch {
+    TreeWatch* next; // Next watch of the same folder.
+    bool recursive; // Does the watch receive events of the whole subtree?
+    atomic_bool closed; // Has the consumer given up the watch?
+    atomic_size_t refs; // Folder list and the users together, see watch_unuse.
+    atomic_size_t users; // Consumer and pending notifications, which need the slots.
+    atomic_size_t push_pos; // Position of the next event to push.
+    atomic_size_t overflow_pos; // Position of the first event pushed after a drop, or NO_OVERFLOW.
+    size_t drain_pos; // Position of the next event to drain, owned by the consumer.
+    WatchSlot* slots; // Ring buffer of WATCH_CAPACITY events, freed with the last user.
+};
+
+TreeWatch* watch_new(bool recursive) {
+    TreeWatch* watch = malloc(sizeof(TreeWatch));
+
+    if (!watch)
+        fatal(__FUNCTION__);
+
+    watch->slots = malloc(WATCH_CAPACITY * sizeof(WatchSlot));
+
+    if (!watch->slots)
+        fatal(__FUNCTION__);
+
+    watch->next = NULL;
+    watch->recursive = recursive;
+    atomic_init(&watch->closed, false);
+    atomic_init(&watch->refs, 2);
+    atomic_init(&watch->users, 1);
+    atomic_init(&watch->push_pos, 0);
+    atomic_init(&watch->overflow_pos, NO_OVERFLOW);
+    watch->drain_pos = 0;
+
+    for (size_t i = 0; i < WATCH_CAPACITY; ++i)
+        atomic_init(&watch->slots[i].sequence, i);
+
+    return watch;
+}
+
+static void watch_release(TreeWatch* watch) {
+    if (atomic_fetch_sub_explicit(&watch->refs, 1, memory_order_acq_rel) == 1)
+        free(watch);
+}
+
+/**
+ * Takes a reference to the slots of a watch for a pending notification,
+ * unless they are gone already, as the watch is closed.
+ * @return could the reference be taken?
+ */
+static bool watch_try_use(TreeWatch* watch) {
+    size_t users = atomic_load_explicit(&watch->users, memory_order_relaxed);
+
+    while (users > 0) {
+        if (atomic_compare_exchange_weak_explicit(&watch->users, &users, users + 1,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Drops a reference to the slots of a watch. The last one frees them with
+ * the events still buffered, so that a closed watch left in a folder list
+ * takes just the few bytes of its header until the list is pruned.
+ */
+static void watch_unuse(TreeWatch* watch) {
+    if (atomic_fetch_sub_explicit(&watch->users, 1, memory_order_acq_rel) != 1)
+        return;
+
+    TreeEvent event;
+    while (watch_drain(watch, &event, 1))
+        watch_event_free(&event);
+
+    free(watch->slots);
+    watch_release(watch);
+}
+
+void watch_close(TreeWatch* watch) {
+    atomic_store_explicit(&watch->closed, true, memory_order_relaxed);
+    watch_unuse(watch);
+}
+
+static bool watch_is_closed(TreeWatch* watch) {
+    return atomic_load_explicit(&watch->closed, memory_order_relaxed);
+}
+
+void watch_list_push(_Atomic(TreeWatch*)* list, TreeWatch* watch) {
+    watch->next = atomic_load_explicit(list, memory_order_relaxed);
+
+    while (!atomic_compare_exchange_weak_explicit(list, &watch->next, watch,
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+void watch_list_prune(_Atomic(TreeWatch*)* list) {
+    TreeWatch* watch = atomic_load_explicit(list, memory_order_relaxed);
+    TreeWatch* prev = NULL;
+
+    while (watch) {
+        TreeWatch* next = watch->next;
+
+        if (watch_is_closed(watch)) {
+            if (prev)
+                prev->next = next;
+            else
+                atomic_store_explicit(list, next, memory_order_relaxed);
+
+            watch_release(watch);
+        } else {
+            prev = watch;
+        }
+
+        watch = next;
+    }
+}
+
+void watch_list_clear(_Atomic(TreeWatch*)* list) {
+    TreeWatch* watch = atomic_exchange_explicit(list, NULL, memory_order_relaxed);
+
+    while (watch) {
+        TreeWatch* next = watch->next;
+        watch_release(watch);
+        watch = next;
+    }
+}
+
+size_t watch_list_memory(_Atomic(TreeWatch*)* list) {
+    size_t memory = 0;
+
+    for (TreeWatch* watch = atomic_load_explicit(list, memory_order_acquire); watch; watch = watch->next) {
+        memory += sizeof(TreeWatch);
+
+        if (atomic_load_explicit(&watch->users, memory_order_relaxed) > 0)
+            memory += WATCH_CAPACITY * sizeof(WatchSlot);
+    }
+
+    return memory;
+}
+
+/** Checks whether @p set already holds @p watch */
+static bool watch_set_contains(WatchSet* set, TreeWatch* watch) {
+    for (size_t i = 0; i < set->count; ++i) {
+        if (set->watches[i] == watch)
+            return true;
+    }
+
+    return false;
+}
+
+void watch_set_collect(WatchSet* set, _Atomic(TreeWatch*)* list, bool direct) {
+    TreeWatch* watch = atomic_load_explicit(list, memory_order_acquire);
+
+    for (; watch; watch = watch->next) {
+        if ((!direct && !watch->recursive) || watch_is_closed(watch))
+            continue;
+        if (watch_set_contains(set, watch) || !watch_try_use(watch))
+            continue;
+
+        if (set->count == set->capacity) {
+            set->capacity = (set->capacity ? 2 * set->capacity : 4);
+            set->watches = realloc(set->watches, set->capacity * sizeof(TreeWatch*));
+
+            if (!set->watches)
+                fatal(__FUNCTION__);
+        }
+
+        set->watches[set->count++] = watch;
+    }
+}
+
+/**
+ * Records that the event at position @p pos of a watch was dropped. Only the
+ * first drop not reported yet is kept: the consumer lists the folder again once
+ * it reaches that drop, which covers the later drops as well.
+ */
+static void watch_overflow(TreeWatch* watch, size_t pos) {
+    size_t recorded = atomic_load_explicit(&watch->overflow_pos, memory_order_relaxed);
+
+    while (pos < recorded) {
+        if (atomic_compare_exchange_weak_explicit(&watch->overflow_pos, &recorded, pos,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return;
+    }
+}
+
+/**
+ * Pushes an event to the ring buffer of a watch. Every slot carries the position
+ * it is expected at: a pusher claims a position with a CAS and publishes the event
+ * by advancing the slot sequence, which is what the consumer waits for.
+ * @return false if the buffer is full
+ */
+static bool watch_push(TreeWatch* watch, const TreeEvent* event) {
+    size_t pos = atomic_load_explicit(&watch->push_pos, memory_order_relaxed);
+
+    while (true) {
+        WatchSlot* slot = &watch->slots[pos % WATCH_CAPACITY];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) sequence - (ptrdiff_t) pos;
+
+        if (diff < 0) {
+            watch_overflow(watch, pos);
+            return false;
+        }
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&watch->push_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->event = *event;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else {
+            pos = atomic_load_explicit(&watch->push_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void watch_set_notify(WatchSet* set, TreeEventType type, const char* path, size_t path_len,
+                      const char* target, size_t target_len) {
+    if (set->count == 0)
+        return;
+
+    // A single copy of the paths serves all the watches.
+    size_t path_size = path_len + 1;
+    size_t target_size = (target ? target_len + 1 : 0);
+    WatchPaths* paths = malloc(sizeof(WatchPaths) + path_size + target_size);
+
+    if (!paths)
+        fatal(__FUNCTION__);
+
+    atomic_init(&paths->refs, set->count);
+    memcpy(paths->chars, path, path_len);
+    paths->chars[path_len] = '\0';
+
+    TreeEvent event = {type, paths->chars, NULL};
+
+    if (target) {
+        memcpy(paths->chars + path_size, target, target_len);
+        paths->chars[path_size + target_len] = '\0';
+        event.target = paths->chars + path_size;
+    }
+
+    for (size_t i = 0; i < set->count; ++i) {
+        TreeWatch* watch = set->watches[i];
+
+        if (!watch_push(watch, &event))
+            watch_paths_release(paths);
+
+        watch_unuse(watch);
+    }
+
+    free(set->watches);
+    *set = WATCH_SET_EMPTY;
+}
+
+void watch_set_release(WatchSet* set) {
+    for (size_t i = 0; i < set->count; ++i)
+        watch_unuse(set->watches[i]);
+
+    free(set->watches);
+    *set = WATCH_SET_EMPTY;
+}
+
+/**
+ * Gives up the overflow recorded at the position of the next event to drain,
+ * or before it, if there is one.
+ * @return should TREE_EVENT_OVERFLOW be reported now?
+ */
+static bool watch_take_overflow(TreeWatch* watch) {
+    size_t pos = atomic_load_explicit(&watch->overflow_pos, memory_order_relaxed);
+
+    while (pos <= watch->drain_pos) {
+        if (atomic_compare_exchange_weak_explicit(&watch->overflow_pos, &pos, NO_OVERFLOW,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return true;
+    }
+
+    return false;
+}
+
+size_t watch_drain(TreeWatch* watch, TreeEvent* events, size_t count) {
+    size_t drained = 0;
+
+    while (drained < count) {
+        // Events buffered before a drop come first, so that a listing taken
+        // in reaction to the overflow is not followed by stale events.
+        if (watch_take_overflow(watch)) {
+            events[drained++] = (TreeEvent){TREE_EVENT_OVERFLOW, NULL, NULL};
+            continue;
+        }
+
+        WatchSlot* slot = &watch->slots[watch->drain_pos % WATCH_CAPACITY];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+        if (sequence != watch->drain_pos + 1)
+            break; // Empty, or the next event is still being written.
+
+        events[drained++] = slot->event;
+        atomic_store_explicit(&slot->sequence, watch->drain_pos + WATCH_CAPACITY, memory_order_release);
+        watch->drain_pos++;
+    }
+
+    return drained;
+}
+
+void watch_event_free(TreeEvent* event) {
+    if (event->path)
+        watch_paths_release((WatchPaths*) (event->path - offsetof(WatchPaths, chars)));
+
+    event->path = NULL;
+    event->target = NULL;
+}
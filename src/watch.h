@@ -0,0 +1,122 @@
+/** @file
+ * Watches delivering change events of a file hierarchy.
+ * Each watch owns a bounded ring buffer that any number of mutators push to
+ * without locking, while a single consumer drains it in batches.
+ * Watches of a folder form a list hanging off the folder; the list is pushed
+ * to with a CAS while the folder is locked for reading, and shrunk only
+ * while it is locked for writing.
+ * @date 2022
+*/
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "tree.h"
+
+/** Number of events a watch buffers before it overflows */
+#define WATCH_CAPACITY 1024
+
+/** Set of watches to notify about a single operation */
+typedef struct WatchSet {
+    TreeWatch** watches;
+    size_t count;
+    size_t capacity;
+} WatchSet;
+
+/** Empty set, which does not allocate until a watch is collected */
+#define WATCH_SET_EMPTY ((WatchSet){NULL, 0, 0})
+
+/**
+ * Creates a watch referenced both by its consumer and by the folder list
+ * it is going to be pushed to.
+ * @param recursive should the watch receive events of the whole subtree?
+ * @return allocated watch
+ */
+TreeWatch* watch_new(bool recursive);
+
+/**
+ * Marks the watch as closed and drops the reference of its consumer.
+ * A closed watch receives no more events. Its buffer is freed once no pending
+ * notification references it, and the rest once it is dropped from the folder list.
+ * @param watch watch to close
+ */
+void watch_close(TreeWatch* watch);
+
+/**
+ * Adds a watch to a folder list. The folder has to be locked at least for reading.
+ * @param list head of the list
+ * @param watch watch to add
+ */
+void watch_list_push(_Atomic(TreeWatch*)* list, TreeWatch* watch);
+
+/**
+ * Drops closed watches from a folder list. The folder has to be locked for writing,
+ * which happens when a folder is removed from it or moved from it, or when a new
+ * watch is added to it.
+ * @param list head of the list
+ */
+void watch_list_prune(_Atomic(TreeWatch*)* list);
+
+/**
+ * Drops all the watches from a folder list, as the folder is about to be freed.
+ * @param list head of the list
+ */
+void watch_list_clear(_Atomic(TreeWatch*)* list);
+
+/**
+ * Gives the number of bytes taken by the watches of a folder list, not including
+ * paths of their pending events, which are shared. The folder has to be locked.
+ * @param list head of the list
+ * @return memory used by the watches
+ */
+size_t watch_list_memory(_Atomic(TreeWatch*)* list);
+
+/**
+ * Adds open watches of a folder list to @p set, taking a reference to each
+ * of them. If @p direct is false, only recursive watches are added, as the
+ * folder is an ancestor of the changed one rather than its parent.
+ * The folder has to be locked. Watches already in @p set are skipped.
+ * @param set set to extend
+ * @param list head of the list
+ * @param direct is the folder a parent of the changed folder?
+ */
+void watch_set_collect(WatchSet* set, _Atomic(TreeWatch*)* list, bool direct);
+
+/**
+ * Pushes an event to every watch of @p set and releases the set. The paths are
+ * copied once and shared by all the watches. Watches with full buffers drop
+ * the event and report an overflow once the events buffered before are drained.
+ * @param set collected watches
+ * @param type type of the event
+ * @param path changed folder or the source of a move, not necessarily null-terminated
+ * @param path_len length of @p path
+ * @param target target of a move or NULL, not necessarily null-terminated
+ * @param target_len length of @p target
+ */
+void watch_set_notify(WatchSet* set, TreeEventType type, const char* path, size_t path_len,
+                      const char* target, size_t target_len);
+
+/**
+ * Releases the watches of @p set without notifying them.
+ * @param set collected watches
+ */
+void watch_set_release(WatchSet* set);
+
+/**
+ * Moves up to @p count buffered events of a watch to @p events.
+ * Must not be called concurrently for the same watch.
+ * @param watch watch to drain
+ * @param events buffer for the events
+ * @param count size of @p events
+ * @return number of events written
+ */
+size_t watch_drain(TreeWatch* watch, TreeEvent* events, size_t count);
+
+/**
+ * Releases the paths of a drained event, which may be shared with other watches.
+ * @param event drained event
+ */
+void watch_event_free(TreeEvent* event);
@@ -0,0 +1,183 @@
+/** @file
+ * Tests of the hash map.
+ * @date 2022
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/hash.h"
+#include "test_util.h"
+
+/** Number of threads inserting concurrently */
+#define THREADS 8
+
+/** Number of keys inserted by each thread */
+#define KEYS 2000
+
+static int compare_keys(const void* p1, const void* p2) {
+    return strcmp(*(const char* const*) p1, *(const char* const*) p2);
+}
+
+/** Checks that @p map holds exactly the keys made of 0, ..., @p count - 1, each as its own value. */
+static void expect_keys(HashMap* map, size_t count) {
+    size_t keys_count;
+    const char** keys = hmap_keys(map, &keys_count);
+    char key[16];
+
+    EXPECT(keys_count == count && hmap_size(map) == count);
+    EXPECT(keys[count] == NULL);
+
+    qsort(keys, count, sizeof(char*), compare_keys);
+
+    for (size_t i = 1; i < count; ++i)
+        EXPECT(strcmp(keys[i - 1], keys[i]) < 0);
+
+    for (unsigned int n = 0; n < count; ++n) {
+        make_name(key, n);
+        EXPECT(hmap_get(map, key) == (void*) (size_t) (n + 1));
+        EXPECT(bsearch(&(const char*){key}, keys, count, sizeof(char*), compare_keys));
+    }
+
+    free(keys);
+}
+
+/** Keys are copied, duplicates are rejected and removed keys can be inserted again. */
+static void test_insert(void) {
+    HashMap* map = hmap_new();
+    char key[16] = "abc";
+    int value;
+
+    EXPECT(hmap_insert(map, key, &value));
+    EXPECT(!hmap_insert(map, "abc", &value));
+    EXPECT(!hmap_insert(map, "abd", NULL));
+
+    strcpy(key, "xyz");
+    EXPECT(hmap_get(map, "abc") == &value);
+    EXPECT(hmap_get(map, "xyz") == NULL);
+
+    EXPECT(hmap_remove(map, "abc"));
+    EXPECT(!hmap_remove(map, "abc"));
+    EXPECT(hmap_get(map, "abc") == NULL);
+    EXPECT(hmap_insert(map, "abc", &value));
+    EXPECT(hmap_size(map) == 1);
+
+    hmap_free(map);
+}
+
+/** Borrowed keys are stored as given, left to their owner and not counted. */
+static void test_borrowed_keys(void) {
+    HashMap* borrowing = hmap_new_borrowing();
+    HashMap* copying = hmap_new();
+    char keys[3][4] = {"abc", "de", "f"};
+    int value;
+
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT(hmap_insert(borrowing, keys[i], &value));
+        EXPECT(hmap_insert(copying, keys[i], &value));
+    }
+
+    EXPECT(!hmap_insert(borrowing, "de", &value));
+
+    size_t count;
+    const char** stored = hmap_keys(borrowing, &count);
+    EXPECT(count == 3);
+
+    for (size_t i = 0; i < count; ++i)
+        EXPECT(stored[i] == keys[0] || stored[i] == keys[1] || stored[i] == keys[2]);
+
+    free(stored);
+
+    EXPECT(hmap_memory(copying).entries - hmap_memory(borrowing).entries == 4 + 3 + 2);
+    EXPECT(hmap_remove(borrowing, "de"));
+    EXPECT(hmap_get(borrowing, "abc") == &value && !hmap_get(borrowing, "de"));
+
+    // The borrowed keys live on the stack, so freeing them would crash.
+    hmap_free(borrowing);
+    hmap_free(copying);
+}
+
+/** Maps grow with hmap_fit and shrink back on their own, keeping all the entries. */
+static void test_fit(void) {
+    HashMap* map = hmap_new();
+    char key[16];
+    unsigned int count = 0;
+    HashMapMemory small = hmap_memory(map);
+
+    for (; count < 10000; ++count) {
+        if (hmap_is_crowded(map))
+            hmap_fit(map);
+
+        make_name(key, count);
+        EXPECT(hmap_insert(map, key, (void*) (size_t) (count + 1)));
+    }
+
+    HashMapMemory grown = hmap_memory(map);
+
+    EXPECT(!hmap_is_crowded(map));
+    EXPECT(grown.table > small.table);
+    expect_keys(map, count);
+
+    while (count > 4) {
+        make_name(key, --count);
+        EXPECT(hmap_remove(map, key));
+    }
+
+    expect_keys(map, count);
+    EXPECT(hmap_memory(map).table < grown.table / 100);
+
+    hmap_fit(map);
+    expect_keys(map, count);
+    EXPECT(hmap_memory(map).table == small.table);
+    hmap_free(map);
+}
+
+typedef struct Inserter {
+    pthread_t thread;
+    HashMap* map;
+    size_t inserted;
+} Inserter;
+
+static void* insert_all(void* data) {
+    Inserter* inserter = data;
+    char key[16];
+
+    for (unsigned int n = 0; n < KEYS; ++n) {
+        make_name(key, n);
+        inserter->inserted += hmap_insert(inserter->map, key, (void*) (size_t) (n + 1));
+    }
+
+    return NULL;
+}
+
+/** Concurrent insertions of the same keys store each of them exactly once. */
+static void test_concurrent_insert(void) {
+    HashMap* map = hmap_new();
+    Inserter inserters[THREADS];
+    size_t inserted = 0;
+
+    for (size_t i = 0; i < THREADS; ++i) {
+        inserters[i] = (Inserter){.map = map, .inserted = 0};
+        EXPECT(pthread_create(&inserters[i].thread, NULL, insert_all, &inserters[i]) == 0);
+    }
+
+    for (size_t i = 0; i < THREADS; ++i) {
+        pthread_join(inserters[i].thread, NULL);
+        inserted += inserters[i].inserted;
+    }
+
+    EXPECT(inserted == KEYS);
+    expect_keys(map, KEYS);
+    hmap_free(map);
+}
+
+int main(void) {
+    test_insert();
+    test_borrowed_keys();
+    test_fit();
+    test_concurrent_insert();
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+/** @file
+ * Tests of path utilities.
+ * @date 2022
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/util/paths.h"
+#include "test_util.h"
+
+static bool is_valid(const char* path) {
+    return is_path_valid(path, strlen(path));
+}
+
+static void test_path_valid(void) {
+    char long_path[MAX_PATH_LENGTH + 2];
+
+    EXPECT(is_valid("/"));
+    EXPECT(is_valid("/a/"));
+    EXPECT(is_valid("/abc/xyz/"));
+    EXPECT(!is_valid(""));
+    EXPECT(!is_valid("a/"));
+    EXPECT(!is_valid("/a"));
+    EXPECT(!is_valid("//"));
+    EXPECT(!is_valid("/a//b/"));
+    EXPECT(!is_valid("/A/"));
+    EXPECT(!is_valid("/a1/"));
+
+    // Only the given length is looked at.
+    EXPECT(is_path_valid("/a/b", 3));
+    EXPECT(!is_path_valid("/a/", 2));
+
+    memset(long_path, 'a', sizeof(long_path));
+    long_path[0] = '/';
+    for (size_t i = 200; i < MAX_PATH_LENGTH; i += 200)
+        long_path[i] = '/';
+
+    long_path[MAX_PATH_LENGTH - 1] = '/';
+    EXPECT(is_path_valid(long_path, MAX_PATH_LENGTH));
+    long_path[MAX_PATH_LENGTH - 1] = 'a';
+    long_path[MAX_PATH_LENGTH] = '/';
+    EXPECT(!is_path_valid(long_path, MAX_PATH_LENGTH + 1));
+
+    // Folder names are limited as well.
+    memset(long_path + 1, 'a', MAX_FOLDER_NAME_LENGTH + 1);
+    long_path[MAX_FOLDER_NAME_LENGTH + 1] = '/';
+    EXPECT(is_path_valid(long_path, MAX_FOLDER_NAME_LENGTH + 2));
+    long_path[MAX_FOLDER_NAME_LENGTH + 1] = 'a';
+    long_path[MAX_FOLDER_NAME_LENGTH + 2] = '/';
+    EXPECT(!is_path_valid(long_path, MAX_FOLDER_NAME_LENGTH + 3));
+}
+
+static void test_path_relations(void) {
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+
+    EXPECT(is_subpath("/a/", 3, "/a/b/", 5));
+    EXPECT(is_subpath("/", 1, "/a/", 3));
+    EXPECT(!is_subpath("/a/", 3, "/a/", 3));
+    EXPECT(!is_subpath("/a/b/", 5, "/a/", 3));
+    EXPECT(!is_subpath("/a/", 3, "/ab/", 4));
+
+    EXPECT(common_path_length("/a/b/", 5, "/a/c/d/", 7) == 3);
+    EXPECT(common_path_length("/ab/", 4, "/ac/", 4) == 1);
+    EXPECT(common_path_length("/a/", 3, "/a/", 3) == 3);
+
+    EXPECT(parent_path_length("/", 1, component) == 0);
+    EXPECT(parent_path_length("/a/", 3, component) == 1);
+    EXPECT(strcmp(component, "a") == 0);
+    EXPECT(parent_path_length("/a/bc/", 6, component) == 3);
+    EXPECT(strcmp(component, "bc") == 0);
+
+    EXPECT(split_path("/", component) == NULL);
+    EXPECT(strcmp(split_path("/ab/c/", component), "/c/") == 0);
+    EXPECT(strcmp(component, "ab") == 0);
+}
+
+static void test_contents_string(void) {
+    const char* names[] = {"c", "a", "b"};
+    char* contents = make_contents_string(names, 3);
+
+    EXPECT(strcmp(contents, "a,b,c") == 0);
+    free(contents);
+
+    contents = make_contents_string(names, 0);
+    EXPECT(strcmp(contents, "") == 0);
+    free(contents);
+}
+
+static bool is_pattern(const char* pattern) {
+    return is_pattern_valid(pattern, strlen(pattern));
+}
+
+static bool is_matching(const char* pattern, const char* folder) {
+    return is_folder_matching(pattern, strlen(pattern), folder);
+}
+
+static void test_pattern_valid(void) {
+    char many[2 * MAX_PATTERN_COMPONENTS + 3] = "";
+
+    EXPECT(is_pattern("*"));
+    EXPECT(is_pattern("**"));
+    EXPECT(is_pattern("/a/**/job*/"));
+    EXPECT(is_pattern("a?c/*x*"));
+    EXPECT(!is_pattern(""));
+    EXPECT(!is_pattern("/"));
+    EXPECT(!is_pattern("a//b"));
+    EXPECT(!is_pattern("a/B"));
+    EXPECT(!is_pattern("a/b-c"));
+
+    for (int i = 0; i < MAX_PATTERN_COMPONENTS; ++i)
+        strcat(many, "a/");
+    EXPECT(is_pattern(many));
+    strcat(many, "a");
+    EXPECT(!is_pattern(many));
+
+    EXPECT(pattern_prefix_length("job*", 4) == 3);
+    EXPECT(pattern_prefix_length("a?c", 3) == 1);
+    EXPECT(pattern_prefix_length("abc", 3) == 3);
+    EXPECT(pattern_prefix_length("*", 1) == 0);
+}
+
+static void test_folder_matching(void) {
+    EXPECT(is_matching("abc", "abc"));
+    EXPECT(!is_matching("abc", "abcd"));
+    EXPECT(!is_matching("abcd", "abc"));
+    EXPECT(is_matching("*", "a"));
+    EXPECT(is_matching("a?c", "abc"));
+    EXPECT(!is_matching("a?c", "ac"));
+    EXPECT(is_matching("job*", "job"));
+    EXPECT(is_matching("job*", "jobs"));
+    EXPECT(!is_matching("job*", "ajob"));
+    EXPECT(is_matching("*job", "ajob"));
+    EXPECT(is_matching("*a*b*", "xaxxbx"));
+    EXPECT(!is_matching("*a*b*", "xbxa"));
+    EXPECT(is_matching("*ab", "aab")); // Backtracks after the first "a".
+    EXPECT(is_matching("?*?", "ab"));
+    EXPECT(!is_matching("?*?", "a"));
+
+    // Only a part of the pattern is compared.
+    EXPECT(is_folder_matching("abc/d", 3, "abc"));
+}
+
+int main(void) {
+    test_path_valid();
+    test_path_relations();
+    test_contents_string();
+    test_pattern_valid();
+    test_folder_matching();
+
+    return 0;
+}
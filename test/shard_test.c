@@ -0,0 +1,212 @@
+/** @file
+ * Tests of the sharded hierarchy, mostly of moves between shards.
+ * @date 2022
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/shard.h"
+#include "test_util.h"
+
+/** Number of shards of tested hierarchies */
+#define SHARDS 4
+
+/** Number of moves made by each of the racing threads */
+#define MOVES 20000
+
+/** Writes to @p folder the first top-level folder "/x/" of a shard other than the one of @p path. */
+static void other_shard_folder(ShardedTree* tree, const char* path, char* folder) {
+    for (char c = 'a'; c <= 'z'; ++c) {
+        sprintf(folder, "/%c/", c);
+
+        if (sharded_tree_shard(tree, folder) != sharded_tree_shard(tree, path))
+            return;
+    }
+
+    EXPECT(false);
+}
+
+/** Folders keep their subtrees when moved between shards, and "/" lists all the shards. */
+static void test_move_across(void) {
+    ShardedTree* tree = sharded_tree_new(SHARDS);
+    char other[8], path[32], target[32], expected[16];
+
+    other_shard_folder(tree, "/a/", other);
+    EXPECT(sharded_tree_shard(tree, "/a/b/c/") == sharded_tree_shard(tree, "/a/"));
+
+    EXPECT(sharded_tree_create(tree, "/a/") == 0);
+    EXPECT(sharded_tree_create(tree, "/a/x/") == 0);
+    EXPECT(sharded_tree_create(tree, "/a/x/y/") == 0);
+    EXPECT(sharded_tree_create(tree, other) == 0);
+    EXPECT(sharded_tree_create(tree, other) == EEXIST);
+
+    sprintf(target, "%sx/", other);
+    EXPECT(sharded_tree_move(tree, "/a/x/", target) == 0);
+    EXPECT_LIST(sharded_tree_list(tree, "/a/"), "");
+    EXPECT_LIST(sharded_tree_list(tree, other), "x");
+    sprintf(path, "%sx/", other);
+    EXPECT_LIST(sharded_tree_list(tree, path), "y");
+
+    EXPECT(sharded_tree_move(tree, "/a/x/", target) == ENOENT);
+    EXPECT(sharded_tree_create(tree, "/a/x/") == 0);
+    EXPECT(sharded_tree_move(tree, "/a/x/", target) == EEXIST);
+    sprintf(target, "%sq/r/", other);
+    EXPECT(sharded_tree_move(tree, "/a/x/", target) == ENOENT);
+    EXPECT(sharded_tree_move(tree, "/", target) == EBUSY);
+    EXPECT(sharded_tree_move(tree, "/a/", "/") == EEXIST);
+
+    sprintf(expected, "a,%c", other[1]);
+    EXPECT_LIST(sharded_tree_list(tree, "/"), expected);
+    EXPECT(sharded_tree_remove(tree, other) == ENOTEMPTY);
+
+    // Top-level folders move between the roots of the shards.
+    sprintf(path, "%sx/y/", other);
+    EXPECT(sharded_tree_remove(tree, path) == 0);
+    sprintf(path, "%sx/", other);
+    EXPECT(sharded_tree_remove(tree, path) == 0);
+    EXPECT(sharded_tree_remove(tree, other) == 0);
+    EXPECT(sharded_tree_move(tree, "/a/", other) == 0);
+    sprintf(expected, "%c", other[1]);
+    EXPECT_LIST(sharded_tree_list(tree, "/"), expected);
+    EXPECT_LIST(sharded_tree_list(tree, other), "x");
+
+    sharded_tree_free(tree);
+}
+
+/** Moves racing in opposite directions between two shards */
+typedef struct Mover {
+    pthread_t thread;
+    ShardedTree* tree;
+    const char* source;
+    const char* target;
+} Mover;
+
+static void* move_back_and_forth(void* data) {
+    Mover* mover = data;
+
+    for (int i = 0; i < MOVES; ++i) {
+        EXPECT(sharded_tree_move(mover->tree, mover->source, mover->target) == 0);
+        EXPECT(sharded_tree_move(mover->tree, mover->target, mover->source) == 0);
+    }
+
+    return NULL;
+}
+
+static void* list_roots(void* data) {
+    ShardedTree* tree = data;
+
+    for (int i = 0; i < MOVES; ++i)
+        free(sharded_tree_list(tree, "/"));
+
+    return NULL;
+}
+
+/** Concurrent moves between two shards in opposite directions neither deadlock nor lose folders. */
+static void test_opposite_moves(void) {
+    ShardedTree* tree = sharded_tree_new(SHARDS);
+    char other[8], there[32], back[32], expected[16];
+    pthread_t lister;
+
+    other_shard_folder(tree, "/a/", other);
+    sprintf(there, "%sx/", other);
+    sprintf(back, "%sy/", other);
+
+    EXPECT(sharded_tree_create(tree, "/a/") == 0);
+    EXPECT(sharded_tree_create(tree, "/a/x/") == 0);
+    EXPECT(sharded_tree_create(tree, other) == 0);
+    EXPECT(sharded_tree_create(tree, back) == 0);
+
+    Mover movers[2] = {
+        {.tree = tree, .source = "/a/x/", .target = there},
+        {.tree = tree, .source = back, .target = "/a/y/"},
+    };
+
+    for (size_t i = 0; i < 2; ++i)
+        EXPECT(pthread_create(&movers[i].thread, NULL, move_back_and_forth, &movers[i]) == 0);
+    EXPECT(pthread_create(&lister, NULL, list_roots, tree) == 0);
+
+    for (size_t i = 0; i < 2; ++i)
+        pthread_join(movers[i].thread, NULL);
+    pthread_join(lister, NULL);
+
+    EXPECT_LIST(sharded_tree_list(tree, "/a/"), "x");
+    EXPECT_LIST(sharded_tree_list(tree, other), "y");
+
+    sprintf(expected, "a,%c", other[1]);
+    EXPECT_LIST(sharded_tree_list(tree, "/"), expected);
+
+    sharded_tree_free(tree);
+}
+
+/** Number of pairs of creations racing with listings of "/" */
+#define CREATIONS 20000
+
+/** Creations of two top-level folders in different shards, one after the other */
+typedef struct Creator {
+    pthread_t thread;
+    ShardedTree* tree;
+    const char* first;
+    const char* second;
+    atomic_bool done;
+} Creator;
+
+static void* create_in_order(void* data) {
+    Creator* creator = data;
+
+    for (int i = 0; i < CREATIONS; ++i) {
+        EXPECT(sharded_tree_create(creator->tree, creator->first) == 0);
+        EXPECT(sharded_tree_create(creator->tree, creator->second) == 0);
+        EXPECT(sharded_tree_remove(creator->tree, creator->second) == 0);
+        EXPECT(sharded_tree_remove(creator->tree, creator->first) == 0);
+    }
+
+    atomic_store(&creator->done, true);
+    return NULL;
+}
+
+/** Listings of "/" never show the folder @p second created without @p first created before it. */
+static void race_ordered_creations(ShardedTree* tree, const char* first, const char* second) {
+    Creator creator = {.tree = tree, .first = first, .second = second};
+    char alone[8];
+
+    sprintf(alone, "%c", second[1]);
+    EXPECT(pthread_create(&creator.thread, NULL, create_in_order, &creator) == 0);
+
+    while (!atomic_load(&creator.done)) {
+        char* list = sharded_tree_list(tree, "/");
+
+        EXPECT(list && strcmp(list, alone) != 0);
+        free(list);
+    }
+
+    pthread_join(creator.thread, NULL);
+    EXPECT_LIST(sharded_tree_list(tree, "/"), "");
+}
+
+/** Listing "/" is atomic with respect to creations of top-level folders in different shards. */
+static void test_list_during_creations(void) {
+    ShardedTree* tree = sharded_tree_new(SHARDS);
+    char other[8];
+
+    other_shard_folder(tree, "/a/", other);
+
+    // The roots are locked in the order of their addresses, so both orders of creations are tried.
+    race_ordered_creations(tree, "/a/", other);
+    race_ordered_creations(tree, other, "/a/");
+
+    sharded_tree_free(tree);
+}
+
+int main(void) {
+    test_move_across();
+    test_opposite_moves();
+    test_list_during_creations();
+
+    return 0;
+}
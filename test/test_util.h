@@ -0,0 +1,54 @@
+/** @file
+ * Helpers shared by the tests and the benchmarks.
+ * @date 2022
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Reports a failed expectation and ends the program */
+#define EXPECT(cond)                                                          \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                          \
+        }                                                                     \
+    } while (0)
+
+/** Checks that a listing @p list, which is freed, equals @p expected */
+#define EXPECT_LIST(list, expected) expect_list_at(__FILE__, __LINE__, (list), (expected))
+
+/** See EXPECT_LIST. */
+static inline void expect_list_at(const char* file, int line, char* list, const char* expected) {
+    if (!list || strcmp(list, expected) != 0) {
+        fprintf(stderr, "%s:%d: expected listing \"%s\", got \"%s\"\n",
+                file, line, expected, list ? list : "(null)");
+        abort();
+    }
+
+    free(list);
+}
+
+/**
+ * Writes base-26 form of @p n, made of letters 'a' to 'z', to @p name.
+ * @return end of the written name
+ */
+static inline char* make_name(char* name, unsigned int n) {
+    do {
+        *name++ = (char) ('a' + n % 26);
+        n /= 26;
+    } while (n);
+
+    *name = '\0';
+    return name;
+}
+
+/** Writes "/" + @p prefix + base-26 form of @p n + "/" to @p path. */
+static inline void make_path(char* path, const char* prefix, unsigned int n) {
+    char* end = make_name(path + sprintf(path, "/%s", prefix), n);
+
+    strcpy(end, "/");
+}
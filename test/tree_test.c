@@ -1 +1,726 @@
+/** @file
+ * Tests of the file hierarchy, mostly of its behaviour under concurrent operations.
+ * @date 2022
+*/
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/tree.h"
+#include "../src/util/paths.h"
+#include "../src/watch.h"
+#include "test_util.h"
+
+/** Number of threads racing in each test */
+#define THREADS 8
+
+/** Operation racing against others, started at once by run_threads */
+typedef struct Racer {
+    pthread_t thread;
+    pthread_barrier_t* start;
+    Tree* tree;
+    size_t index;
+    int result;
+} Racer;
+
+typedef void (*RacerBody)(Racer* racer);
+
+typedef struct RacerStart {
+    Racer* racer;
+    RacerBody body;
+} RacerStart;
+
+static void* run_racer(void* data) {
+    RacerStart* start = data;
+
+    pthread_barrier_wait(start->racer->start);
+    start->body(start->racer);
+
+    return NULL;
+}
+
+/** Runs @p count racers, each running @p body, and waits for all of them. */
+static void run_threads(Racer* racers, size_t count, Tree* tree, RacerBody body) {
+    pthread_barrier_t start;
+    RacerStart starts[THREADS];
+
+    EXPECT(count <= THREADS);
+    pthread_barrier_init(&start, NULL, count);
+
+    for (size_t i = 0; i < count; ++i) {
+        racers[i] = (Racer){.start = &start, .tree = tree, .index = i};
+        starts[i] = (RacerStart){&racers[i], body};
+        EXPECT(pthread_create(&racers[i].thread, NULL, run_racer, &starts[i]) == 0);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        pthread_join(racers[i].thread, NULL);
+
+    pthread_barrier_destroy(&start);
+}
+
+static void create_same(Racer* racer) {
+    racer->result = tree_create(racer->tree, "/a/same/");
+}
+
+/** Exactly one of concurrent creations of a folder succeeds. */
+static void test_create_same_name(void) {
+    for (int round = 0; round < 200; ++round) {
+        Tree* tree = tree_new();
+        Racer racers[THREADS];
+        size_t created = 0;
+
+        EXPECT(tree_create(tree, "/a/") == 0);
+        run_threads(racers, THREADS, tree, create_same);
+
+        for (size_t i = 0; i < THREADS; ++i) {
+            EXPECT(racers[i].result == 0 || racers[i].result == EEXIST);
+            created += (racers[i].result == 0);
+        }
+
+        EXPECT(created == 1);
+        EXPECT_LIST(tree_list(tree, "/a/"), "same");
+        tree_free(tree);
+    }
+}
+
+static void create_or_remove(Racer* racer) {
+    if (racer->index == 0)
+        racer->result = tree_remove(racer->tree, "/a/");
+    else
+        racer->result = tree_create(racer->tree, "/a/b/");
+}
+
+/**
+ * A creation inside a folder racing with its removal either comes first and makes
+ * the removal fail with ENOTEMPTY, or comes second and fails with ENOENT.
+ */
+static void test_create_during_remove(void) {
+    for (int round = 0; round < 500; ++round) {
+        Tree* tree = tree_new();
+        Racer racers[2];
+
+        EXPECT(tree_create(tree, "/a/") == 0);
+        run_threads(racers, 2, tree, create_or_remove);
+
+        int removed = racers[0].result;
+        int created = racers[1].result;
+
+        if (removed == 0) {
+            EXPECT(created == ENOENT);
+            EXPECT_LIST(tree_list(tree, "/"), "");
+        } else {
+            EXPECT(removed == ENOTEMPTY && created == 0);
+            EXPECT_LIST(tree_list(tree, "/a/"), "b");
+        }
+
+        tree_free(tree);
+    }
+}
+
+/** Number of times the racers of test_create_around_slots fill and empty their folder */
+#define SLOT_ROUNDS 2000
+
+static void create_and_remove(Racer* racer) {
+    char first[16], second[16];
+
+    make_path(first, "a/", racer->index);
+    make_path(second, "a/", racer->index + THREADS);
+
+    // Waiting for each other, the racers cross the slots limit up and down in every round.
+    for (int i = 0; i < SLOT_ROUNDS; ++i) {
+        EXPECT(tree_create(racer->tree, first) == 0);
+        pthread_barrier_wait(racer->start);
+
+        EXPECT(tree_remove(racer->tree, first) == 0);
+        EXPECT(tree_create(racer->tree, second) == 0);
+        pthread_barrier_wait(racer->start);
+
+        EXPECT(tree_remove(racer->tree, second) == 0);
+        pthread_barrier_wait(racer->start);
+    }
+
+    EXPECT(tree_create(racer->tree, first) == 0);
+}
+
+/**
+ * Creations of distinct names racing with removals in one folder, which retry for
+ * moving its children from the slots to a map and give them back to the slots once
+ * few are left, neither lose nor duplicate a child.
+ */
+static void test_create_around_slots(void) {
+    Tree* tree = tree_new();
+    Racer racers[THREADS];
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+    run_threads(racers, THREADS, tree, create_and_remove);
+
+    EXPECT_LIST(tree_list(tree, "/a/"), "a,b,c,d,e,f,g,h");
+    tree_free(tree);
+}
+
+/** Writes a random path of one to three folders named "a" to "c" to @p path. */
+static void random_path(unsigned int* seed, char* path) {
+    int depth = 1 + rand_r(seed) % 3;
+
+    *path++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *path++ = (char) ('a' + rand_r(seed) % 3);
+        *path++ = '/';
+    }
+
+    *path = '\0';
+}
+
+static void random_operations(Racer* racer) {
+    unsigned int seed = racer->index + 1;
+    char path[16], target[16];
+
+    for (int i = 0; i < 20000; ++i) {
+        random_path(&seed, path);
+        random_path(&seed, target);
+
+        switch (rand_r(&seed) % 9) {
+            case 0:
+            case 1:
+                tree_create(racer->tree, path);
+                break;
+            case 2:
+            case 3:
+                tree_remove(racer->tree, path);
+                break;
+            case 4:
+            case 5:
+                tree_move(racer->tree, path, target);
+                break;
+            case 6:
+                tree_compact(racer->tree, path);
+                break;
+            default:
+                free(tree_list(racer->tree, path));
+        }
+    }
+}
+
+/** Size of path buffers of check_and_empty, moves may nest folders deeply */
+#define PATH_BUFFER_SIZE 4096
+
+/**
+ * Checks that every listed child of @p path can be listed in turn and removed
+ * once emptied, which leaves @p path empty.
+ * @param path buffer of PATH_BUFFER_SIZE bytes holding a path
+ */
+static void check_and_empty(Tree* tree, char* path) {
+    size_t len = strlen(path);
+    char* list = tree_list(tree, path);
+    char* rest;
+
+    EXPECT(list);
+
+    for (char* folder = strtok_r(list, ",", &rest); folder; folder = strtok_r(NULL, ",", &rest)) {
+        EXPECT(len + strlen(folder) + 2 <= PATH_BUFFER_SIZE);
+        sprintf(path + len, "%s/", folder);
+        check_and_empty(tree, path);
+        EXPECT(tree_remove(tree, path) == 0);
+        path[len] = '\0';
+    }
+
+    free(list);
+    EXPECT_LIST(tree_list(tree, path), "");
+}
+
+/** Random concurrent operations leave a hierarchy that can be walked and taken apart. */
+static void test_random_operations(void) {
+    Tree* tree = tree_new();
+    Racer racers[THREADS];
+    char path[PATH_BUFFER_SIZE] = "/";
+
+    run_threads(racers, THREADS, tree, random_operations);
+    check_and_empty(tree, path);
+    tree_free(tree);
+}
+
+/**
+ * An overflow is reported after the events buffered before the first lost one,
+ * and events shared by several watches are released by each of them.
+ */
+static void test_watch_overflow(void) {
+    Tree* tree = tree_new();
+    TreeWatch* watch = tree_watch(tree, "/", false);
+    TreeWatch* other = tree_watch(tree, "/", true);
+    TreeEvent events[WATCH_CAPACITY + 8];
+    char path[16];
+
+    for (unsigned int n = 0; n < WATCH_CAPACITY + 100; ++n) {
+        make_path(path, "", n);
+        EXPECT(tree_create(tree, path) == 0);
+    }
+
+    size_t count = tree_watch_drain(watch, events, WATCH_CAPACITY + 8);
+    EXPECT(count == WATCH_CAPACITY + 1);
+
+    for (unsigned int n = 0; n < WATCH_CAPACITY; ++n) {
+        make_path(path, "", n);
+        EXPECT(events[n].type == TREE_EVENT_CREATE && strcmp(events[n].path, path) == 0);
+    }
+
+    EXPECT(events[WATCH_CAPACITY].type == TREE_EVENT_OVERFLOW && !events[WATCH_CAPACITY].path);
+
+    for (size_t i = 0; i < count; ++i)
+        tree_event_free(&events[i]);
+
+    EXPECT(tree_create(tree, "/new/") == 0);
+    EXPECT(tree_watch_drain(watch, events, 2) == 1);
+    EXPECT(events[0].type == TREE_EVENT_CREATE && strcmp(events[0].path, "/new/") == 0);
+    tree_event_free(&events[0]);
+
+    // The other watch still holds its copies of the same events.
+    EXPECT(tree_watch_drain(other, events, 1) == 1);
+    EXPECT(strcmp(events[0].path, "/a/") == 0);
+    tree_event_free(&events[0]);
+
+    tree_unwatch(other);
+    tree_unwatch(watch);
+    tree_free(tree);
+}
+
+/** Checks that the next event of @p watch is of @p type, with given paths, or NULL for none. */
+static void expect_event(TreeWatch* watch, TreeEventType type, const char* path, const char* target) {
+    TreeEvent event;
+
+    EXPECT(tree_watch_drain(watch, &event, 1) == 1);
+    EXPECT(event.type == type);
+    EXPECT(path ? event.path && strcmp(event.path, path) == 0 : !event.path);
+    EXPECT(target ? event.target && strcmp(event.target, target) == 0 : !event.target);
+    tree_event_free(&event);
+}
+
+static void expect_no_event(TreeWatch* watch) {
+    TreeEvent event;
+
+    EXPECT(tree_watch_drain(watch, &event, 1) == 0);
+}
+
+/**
+ * A move is reported to watches of both parents, with its source and target.
+ * Folders are packed first, so that the moved one is copied out of its arena.
+ */
+static void test_watch_move(void) {
+    Tree* tree = tree_new();
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+    EXPECT(tree_create(tree, "/b/") == 0);
+    EXPECT(tree_create(tree, "/a/x/") == 0);
+    EXPECT(tree_create(tree, "/a/z/") == 0);
+    EXPECT(tree_compact(tree, "/") == 0);
+
+    TreeWatch* source = tree_watch(tree, "/a/", false);
+    TreeWatch* target = tree_watch(tree, "/b/", false);
+    TreeWatch* root = tree_watch(tree, "/", false);
+
+    EXPECT(tree_move(tree, "/a/x/", "/b/y/") == 0);
+    expect_event(source, TREE_EVENT_MOVE, "/a/x/", "/b/y/");
+    expect_event(target, TREE_EVENT_MOVE, "/a/x/", "/b/y/");
+    expect_no_event(root); // Only children of the root are watched.
+
+    // A failed move is not reported.
+    EXPECT(tree_move(tree, "/a/x/", "/b/w/") == ENOENT);
+    expect_no_event(source);
+
+    // A rename within a folder is reported once.
+    EXPECT(tree_move(tree, "/a/z/", "/a/w/") == 0);
+    expect_event(source, TREE_EVENT_MOVE, "/a/z/", "/a/w/");
+    expect_no_event(source);
+    expect_no_event(target);
+
+    tree_unwatch(root);
+    tree_unwatch(target);
+    tree_unwatch(source);
+    tree_free(tree);
+}
+
+/** Recursive watches see changes at any depth, others only among children. */
+static void test_watch_recursive(void) {
+    Tree* tree = tree_new();
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+
+    TreeWatch* recursive = tree_watch(tree, "/a/", true);
+    TreeWatch* direct = tree_watch(tree, "/a/", false);
+
+    EXPECT(tree_create(tree, "/a/b/") == 0);
+    EXPECT(tree_create(tree, "/a/b/c/") == 0);
+    EXPECT(tree_move(tree, "/a/b/c/", "/c/") == 0);
+    EXPECT(tree_remove(tree, "/a/b/") == 0);
+
+    expect_event(recursive, TREE_EVENT_CREATE, "/a/b/", NULL);
+    expect_event(recursive, TREE_EVENT_CREATE, "/a/b/c/", NULL);
+    expect_event(recursive, TREE_EVENT_MOVE, "/a/b/c/", "/c/");
+    expect_event(recursive, TREE_EVENT_REMOVE, "/a/b/", NULL);
+    expect_no_event(recursive);
+
+    expect_event(direct, TREE_EVENT_CREATE, "/a/b/", NULL);
+    expect_event(direct, TREE_EVENT_REMOVE, "/a/b/", NULL);
+    expect_no_event(direct);
+
+    tree_unwatch(direct);
+    tree_unwatch(recursive);
+    tree_free(tree);
+}
+
+/** Removal of a watched folder is its last event, even if a namesake is created later. */
+static void test_watch_removed(void) {
+    Tree* tree = tree_new();
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+    EXPECT(tree_create(tree, "/a/b/") == 0);
+
+    TreeWatch* watch = tree_watch(tree, "/a/b/", true);
+
+    EXPECT(tree_remove(tree, "/a/b/") == 0);
+    EXPECT(tree_create(tree, "/a/b/") == 0);
+    EXPECT(tree_create(tree, "/a/b/c/") == 0);
+
+    expect_event(watch, TREE_EVENT_REMOVE, "/a/b/", NULL);
+    expect_no_event(watch);
+
+    tree_unwatch(watch);
+    tree_free(tree);
+}
+
+/** A watch follows its folder when it is moved, reporting changes under the new path. */
+static void test_watch_follows_move(void) {
+    Tree* tree = tree_new();
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+    EXPECT(tree_create(tree, "/a/b/") == 0);
+    EXPECT(tree_create(tree, "/a/c/") == 0);
+    EXPECT(tree_create(tree, "/d/") == 0);
+    EXPECT(tree_compact(tree, "/") == 0);
+
+    TreeWatch* watch = tree_watch(tree, "/a/b/", false);
+
+    EXPECT(tree_move(tree, "/a/b/", "/d/e/") == 0);
+    EXPECT(tree_create(tree, "/d/e/f/") == 0);
+    EXPECT(tree_move(tree, "/d/", "/a/c/d/") == 0);
+    EXPECT(tree_remove(tree, "/a/c/d/e/f/") == 0);
+
+    expect_event(watch, TREE_EVENT_CREATE, "/d/e/f/", NULL);
+    expect_event(watch, TREE_EVENT_REMOVE, "/a/c/d/e/f/", NULL);
+    expect_no_event(watch);
+
+    EXPECT(tree_remove(tree, "/a/c/d/e/") == 0);
+    expect_event(watch, TREE_EVENT_REMOVE, "/a/c/d/e/", NULL);
+
+    tree_unwatch(watch);
+    tree_free(tree);
+}
+
+/** Closed watches give back their memory even in folders which only get new children. */
+static void test_unwatch_memory(void) {
+    Tree* tree = tree_new();
+    TreeMemory open, closed;
+    char path[16];
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+
+    TreeWatch* watch = tree_watch(tree, "/a/", false);
+    EXPECT(tree_memory(tree, "/a/", &open) == 0);
+    tree_unwatch(watch);
+    EXPECT(tree_memory(tree, "/a/", &closed) == 0);
+    EXPECT(closed.watches * 16 < open.watches);
+
+    for (unsigned int n = 0; n < 1000; ++n) {
+        tree_unwatch(tree_watch(tree, "/a/", true));
+        make_path(path, "a/", n);
+        EXPECT(tree_create(tree, path) == 0);
+    }
+
+    EXPECT(tree_memory(tree, "/a/", &closed) == 0);
+    EXPECT(closed.watches <= open.watches);
+    tree_free(tree);
+}
+
+/** Folders reported by tree_find */
+typedef struct Found {
+    char* paths[1024];
+    size_t count;
+} Found;
+
+static int collect(const char* path, void* arg) {
+    Found* found = arg;
+
+    EXPECT(found->count < 1024);
+    found->paths[found->count++] = strdup(path);
+
+    return 0;
+}
+
+static int compare_paths(const void* p1, const void* p2) {
+    return strcmp(*(char* const*) p1, *(char* const*) p2);
+}
+
+/**
+ * Checks that tree_find in @p root reports exactly @p count folders, sorted in
+ * @p expected, or any @p count distinct folders if @p expected is NULL.
+ */
+static void expect_found(Tree* tree, const char* root, const char* pattern, int result,
+                         const char* const* expected, size_t count) {
+    Found found = {.count = 0};
+
+    EXPECT(tree_find(tree, root, pattern, collect, &found) == result);
+    EXPECT(found.count == count);
+    qsort(found.paths, found.count, sizeof(char*), compare_paths);
+
+    for (size_t i = 0; i < found.count; ++i) {
+        EXPECT(!expected || strcmp(found.paths[i], expected[i]) == 0);
+        EXPECT(i == 0 || strcmp(found.paths[i - 1], found.paths[i]) < 0);
+    }
+
+    for (size_t i = 0; i < found.count; ++i)
+        free(found.paths[i]);
+}
+
+/** Searches report folders below the root once each, looking literal names up directly. */
+static void test_find(void) {
+    Tree* tree = tree_new();
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+    EXPECT(tree_create(tree, "/a/b/") == 0);
+    EXPECT(tree_create(tree, "/a/b/c/") == 0);
+    EXPECT(tree_create(tree, "/a/jobx/") == 0);
+    EXPECT(tree_create(tree, "/job/") == 0);
+
+    const char* all[] = {"/a/", "/a/b/", "/a/b/c/", "/a/jobx/", "/job/"};
+    expect_found(tree, "/", "**", 0, all, 5);
+    expect_found(tree, "/", "**/**", 0, all, 5);
+    expect_found(tree, "/a/", "**", 0, all + 1, 3);
+    expect_found(tree, "/a/b/c/", "**", 0, NULL, 0);
+
+    const char* jobs[] = {"/a/jobx/", "/job/"};
+    expect_found(tree, "/", "**/job*", 0, jobs, 2);
+
+    const char* literal[] = {"/a/b/"};
+    expect_found(tree, "/", "a/b", 0, literal, 1);
+    expect_found(tree, "/", "/a/b/", 0, literal, 1);
+    expect_found(tree, "/", "a/x", 0, NULL, 0);
+
+    expect_found(tree, "/x/", "*", ENOENT, NULL, 0);
+    expect_found(tree, "/", "A", EINVAL, NULL, 0);
+
+    // A folder large enough to be split among threads, given several processors.
+    char path[16];
+    EXPECT(tree_create(tree, "/big/") == 0);
+    for (unsigned int n = 0; n < 300; ++n) {
+        make_path(path, "big/", n);
+        EXPECT(tree_create(tree, path) == 0);
+        strcat(path, "leaf/");
+        EXPECT(tree_create(tree, path) == 0);
+    }
+
+    expect_found(tree, "/big/", "*/leaf", 0, NULL, 300);
+    expect_found(tree, "/", "big/*", 0, NULL, 300);
+    expect_found(tree, "/", "**/leaf", 0, NULL, 300);
+
+    tree_free(tree);
+}
+
+static int collect_ten(const char* path, void* arg) {
+    Found* found = arg;
+
+    collect(path, arg);
+    return found->count == 10;
+}
+
+/**
+ * Large subtrees below a folder with few children are shared among threads as well,
+ * and a search asked to stop reports nothing more.
+ */
+static void test_find_nested(void) {
+    Tree* tree = tree_new();
+    char path[32];
+
+    EXPECT(tree_create(tree, "/t/") == 0);
+    for (unsigned int tenant = 0; tenant < 4; ++tenant) {
+        make_path(path, "t/", tenant);
+        EXPECT(tree_create(tree, path) == 0);
+
+        // Names of tenants have a single letter, so their paths take 5 characters.
+        for (unsigned int n = 0; n < 40; ++n) {
+            char* end = make_name(path + 5, n);
+            strcpy(end, "/");
+            EXPECT(tree_create(tree, path) == 0);
+
+            for (unsigned int leaf = 0; leaf < 5; ++leaf) {
+                make_name(end + 1, leaf);
+                strcat(end, "/");
+                EXPECT(tree_create(tree, path) == 0);
+            }
+        }
+    }
+
+    expect_found(tree, "/t/", "**", 0, NULL, 4 + 4 * 40 + 4 * 40 * 5);
+    expect_found(tree, "/t/", "*/*/b", 0, NULL, 4 * 40);
+
+    Found found = {.count = 0};
+    EXPECT(tree_find(tree, "/", "**", collect_ten, &found) == 0);
+    EXPECT(found.count == 10);
+
+    for (size_t i = 0; i < found.count; ++i)
+        free(found.paths[i]);
+
+    tree_free(tree);
+}
+
+/** Folders nested by moves deeper than any path reaches are reported as skipped. */
+static void test_find_too_deep(void) {
+    Tree* tree = tree_new();
+    char path[MAX_PATH_LENGTH + 1] = "/b/";
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+
+    memset(name, 'x', MAX_FOLDER_NAME_LENGTH);
+    name[MAX_FOLDER_NAME_LENGTH] = '\0';
+
+    EXPECT(tree_create(tree, path) == 0);
+    for (int i = 0; i < 15; ++i) {
+        sprintf(path + strlen(path), "%s/", name);
+        EXPECT(tree_create(tree, path) == 0);
+    }
+
+    expect_found(tree, "/", "**", 0, NULL, 16);
+
+    sprintf(path, "/%s/", name);
+    EXPECT(tree_create(tree, path) == 0);
+    strcat(path, "b/");
+    EXPECT(tree_move(tree, "/b/", path) == 0);
+
+    // The last folder of the chain would have a path longer than MAX_PATH_LENGTH.
+    expect_found(tree, "/", "**", ENAMETOOLONG, NULL, 16);
+
+    tree_free(tree);
+}
+
+/** Packed folders take their whole block until most of it is dead, then give it back. */
+static void test_compact_memory(void) {
+    Tree* tree = tree_new();
+    TreeMemory scattered, packed, memory;
+    char path[16], target[16];
+    int n = 1000;
+
+    EXPECT(tree_create(tree, "/a/") == 0);
+    EXPECT(tree_create(tree, "/b/") == 0);
+    for (int i = 0; i < n; ++i) {
+        make_path(path, "a/", (unsigned int) i);
+        EXPECT(tree_create(tree, path) == 0);
+    }
+
+    EXPECT(tree_memory(tree, "/a/", &scattered) == 0);
+    size_t node = scattered.nodes / (n + 1);
+
+    EXPECT(tree_compact(tree, "/a/") == 0);
+    EXPECT(tree_memory(tree, "/a/", &packed) == 0);
+    EXPECT(packed.nodes > scattered.nodes);
+
+    // Removed and moved folders leave dead places behind.
+    while (n > 500) {
+        make_path(path, "a/", (unsigned int) --n);
+        EXPECT(tree_remove(tree, path) == 0);
+    }
+
+    while (n > 300) {
+        make_path(path, "a/", (unsigned int) --n);
+        make_path(target, "b/", (unsigned int) n);
+        EXPECT(tree_move(tree, path, target) == 0);
+    }
+
+    EXPECT(tree_memory(tree, "/a/", &memory) == 0);
+    EXPECT(memory.nodes == packed.nodes);
+
+    // Below a quarter of the block the rest is copied out of it.
+    while (n > 1) {
+        make_path(path, "a/", (unsigned int) --n);
+        EXPECT(tree_remove(tree, path) == 0);
+    }
+
+    EXPECT(tree_memory(tree, "/a/", &memory) == 0);
+    EXPECT(memory.nodes == 2 * node);
+    EXPECT_LIST(tree_list(tree, "/a/"), "a");
+
+    EXPECT(tree_memory(tree, "/b/", &memory) == 0);
+    EXPECT(memory.nodes == 201 * node);
+
+    tree_free(tree);
+}
+
+/** Has the move of test_move_out_of_sparse_arena finished? */
+static atomic_bool moved;
+
+static void move_or_list(Racer* racer) {
+    if (racer->index == 0) {
+        racer->result = tree_move(racer->tree, "/p/b/", "/p/a/q/b/");
+        atomic_store(&moved, true);
+        return;
+    }
+
+    // Listings walk through "/p/a/", holding it while they wait for the target.
+    while (!atomic_load(&moved))
+        free(tree_list(racer->tree, "/p/a/q/"));
+}
+
+/**
+ * A move leaving its arena sparse copies the siblings out only after letting go of
+ * the target, which may lie below one of them, with walks holding that sibling.
+ */
+static void test_move_out_of_sparse_arena(void) {
+    for (int round = 0; round < 50; ++round) {
+        Tree* tree = tree_new();
+        Racer racers[4];
+        char path[16];
+
+        EXPECT(tree_create(tree, "/p/") == 0);
+        for (unsigned int n = 0; n < 8; ++n) {
+            make_path(path, "p/", n);
+            EXPECT(tree_create(tree, path) == 0);
+        }
+
+        EXPECT(tree_create(tree, "/p/a/q/") == 0);
+        EXPECT(tree_compact(tree, "/p/") == 0);
+
+        for (unsigned int n = 2; n < 8; ++n) {
+            make_path(path, "p/", n);
+            EXPECT(tree_remove(tree, path) == 0);
+        }
+
+        atomic_store(&moved, false);
+        run_threads(racers, 4, tree, move_or_list);
+
+        EXPECT(racers[0].result == 0);
+        EXPECT_LIST(tree_list(tree, "/p/"), "a");
+        EXPECT_LIST(tree_list(tree, "/p/a/q/"), "b");
+        tree_free(tree);
+    }
+}
+
+int main(void) {
+    test_create_same_name();
+    test_create_during_remove();
+    test_create_around_slots();
+    test_random_operations();
+    test_watch_overflow();
+    test_unwatch_memory();
+    test_watch_move();
+    test_watch_recursive();
+    test_watch_removed();
+    test_watch_follows_move();
+    test_find();
+    test_find_nested();
+    test_find_too_deep();
+    test_compact_memory();
+    test_move_out_of_sparse_arena();
+
+    return 0;
+}
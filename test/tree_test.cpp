@@ -0,0 +1,204 @@
+/** @file
+ * Tests of the C++ interface of the file hierarchy.
+ * @date 2022
+*/
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../src/tree.hpp"
+#include "test_util.h"
+
+namespace fm = file_manager;
+
+static_assert(!std::is_copy_constructible_v<fm::Tree> && !std::is_copy_assignable_v<fm::Tree>);
+static_assert(std::is_nothrow_move_constructible_v<fm::Tree> && std::is_nothrow_move_assignable_v<fm::Tree>);
+static_assert(!std::is_copy_constructible_v<fm::Watch> && !std::is_copy_assignable_v<fm::Watch>);
+static_assert(std::is_nothrow_move_constructible_v<fm::Watch> && std::is_nothrow_move_assignable_v<fm::Watch>);
+
+/** Joins names of @p listing with commas, like tree_list does. */
+static std::string join(const fm::Listing& listing) {
+    std::string joined;
+
+    for (std::string_view name : listing) {
+        if (!joined.empty())
+            joined += ',';
+        joined += name;
+    }
+
+    return joined;
+}
+
+/** Checks that the next event of @p watch is @p type of @p path. */
+static void expect_event(fm::Watch& watch, TreeEventType type, const char* path) {
+    TreeEvent event;
+
+    EXPECT(watch.drain(&event, 1) == 1);
+    EXPECT(event.type == type && std::string_view(event.path) == path);
+    tree_event_free(&event);
+}
+
+/** Handles hand over their hierarchy and watch when moved, leaving the source empty. */
+static void test_move_only_handles() {
+    fm::Tree tree;
+    ::Tree* raw = tree.get();
+
+    EXPECT(tree.create("/a/") == 0);
+
+    fm::Tree moved(std::move(tree));
+    EXPECT(moved.get() == raw && !tree.get());
+    EXPECT(join(moved.list("/")) == "a");
+
+    fm::Tree other;
+    other = std::move(moved);
+    EXPECT(other.get() == raw);
+    EXPECT(join(other.list("/")) == "a");
+
+    fm::Watch watch = other.watch("/a/", false);
+    EXPECT(watch);
+
+    fm::Watch taken(std::move(watch));
+    EXPECT(taken && !watch);
+
+    fm::Watch assigned;
+    assigned = std::move(taken);
+    EXPECT(assigned && !taken);
+
+    EXPECT(other.create("/a/b/") == 0);
+    expect_event(assigned, TREE_EVENT_CREATE, "/a/b/");
+
+    EXPECT(!other.watch("/x/", false));
+}
+
+/** A listing keeps the names it was made with, whatever happens to the folder later. */
+static void test_listing_outlives_changes() {
+    fm::Tree tree;
+
+    EXPECT(tree.create("/a/") == 0);
+    EXPECT(tree.create("/a/b/") == 0);
+    EXPECT(tree.create("/a/c/") == 0);
+
+    fm::Listing listing = tree.list("/a/");
+
+    EXPECT(tree.remove("/a/b/") == 0);
+    EXPECT(tree.create("/a/d/") == 0);
+    EXPECT(tree.move("/a/", "/e/") == 0);
+    EXPECT(tree.remove("/e/c/") == 0);
+    EXPECT(tree.remove("/e/d/") == 0);
+    EXPECT(tree.remove("/e/") == 0);
+
+    EXPECT(listing && listing.size() == 2);
+    EXPECT(listing[0] == "b" && listing[1] == "c");
+    EXPECT(join(tree.list("/")) == "");
+    EXPECT(!tree.list("/a/"));
+}
+
+/** Copies of a listing borrow names from one snapshot, which lives as long as any of them. */
+static void test_listing_copies() {
+    fm::Tree tree;
+
+    EXPECT(tree.create("/a/") == 0);
+    EXPECT(tree.create("/b/") == 0);
+
+    fm::Listing copy;
+    std::vector<fm::Listing> copies;
+
+    {
+        fm::Listing listing = tree.list("/");
+
+        copy = listing;
+        copies.assign(3, listing);
+
+        EXPECT(copy[0].data() == listing[0].data());
+        for (const fm::Listing& other : copies)
+            EXPECT(other[1].data() == listing[1].data());
+    }
+
+    EXPECT(tree.remove("/a/") == 0);
+    copies.clear();
+
+    fm::Listing moved(std::move(copy));
+    EXPECT(!copy && copy.empty());
+    EXPECT(join(moved) == "a,b");
+}
+
+/** An exception thrown by a callback stops the search and reaches the caller. */
+static void test_find_rethrows() {
+    fm::Tree tree;
+    int calls = 0;
+
+    EXPECT(tree.create("/a/") == 0);
+    EXPECT(tree.create("/a/b/") == 0);
+    EXPECT(tree.create("/c/") == 0);
+
+    try {
+        tree.find("/", "**", [&calls](std::string_view path) -> bool {
+            ++calls;
+            throw std::runtime_error(std::string(path));
+        });
+        EXPECT(false);
+    } catch (const std::runtime_error& error) {
+        EXPECT(calls == 1);
+        EXPECT(std::string_view(error.what()).front() == '/');
+    }
+
+    // Locks were released, so the hierarchy can still be changed.
+    EXPECT(tree.remove("/a/b/") == 0);
+    EXPECT(tree.create("/a/d/") == 0);
+    EXPECT(tree.find("/", "*/d", [](std::string_view path) { return path == "/a/d/"; }) == 0);
+}
+
+/** Paths given as slices of larger strings are read only up to their length. */
+static void test_slices() {
+    fm::Tree tree;
+    std::string_view text = "/a/b/c/ and the rest";
+    std::string_view a = text.substr(0, 3), ab = text.substr(0, 5), abc = text.substr(0, 7);
+    std::string_view moved = std::string_view("/x/y/z").substr(0, 3);
+
+    EXPECT(tree.create(a) == 0);
+    EXPECT(tree.create(ab) == 0);
+    EXPECT(tree.create(abc) == 0);
+    EXPECT(tree.create(a) == EEXIST);
+    EXPECT(tree.create(text.substr(0, 4)) == EINVAL);
+
+    EXPECT(join(tree.list(a)) == "b");
+    EXPECT(join(tree.list(ab)) == "c");
+    EXPECT(join(tree.list(abc)) == "");
+
+    TreeMemory memory;
+    EXPECT(tree.memory(ab, memory) == 0);
+    EXPECT(tree.compact(ab) == 0);
+
+    fm::Watch watch = tree.watch(ab, false);
+    EXPECT(watch);
+
+    int found = 0;
+    EXPECT(tree.find(ab, text.substr(5, 1), [&found](std::string_view path) {
+        found += (path == "/a/b/c/");
+        return true;
+    }) == 0);
+    EXPECT(found == 1);
+
+    EXPECT(tree.move(abc, moved) == 0);
+    expect_event(watch, TREE_EVENT_MOVE, "/a/b/c/");
+    EXPECT(join(tree.list("/")) == "a,x");
+    EXPECT(tree.remove(moved) == 0);
+    EXPECT(tree.remove(ab) == 0);
+    EXPECT(tree.remove(a) == 0);
+    EXPECT(join(tree.list("/")) == "");
+}
+
+int main() {
+    test_move_only_handles();
+    test_listing_outlives_changes();
+    test_listing_copies();
+    test_find_rethrows();
+    test_slices();
+
+    return 0;
+}